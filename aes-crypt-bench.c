@@ -0,0 +1,380 @@
+/* aes-crypt-bench.c
+ * Microbenchmark of the aes-crypt library, no files or FUSE involved
+ *
+ * Drives do_crypt (through in-memory streams), do_crypt_fd, do_crypt_buf, do_crypt_chunk
+ * and do_crypt_chunks over in-memory inputs and prints GB/s and cycles/byte for each
+ * API, cipher mode, direction, buffer or chunk size and worker thread count.
+ * Compare with the seqread and copy lines of encfs-bench to see how much of the
+ * mount's cost is crypto.
+ *
+ * The worker pool can only be configured once per process, so every thread count
+ * of the do_crypt_chunks runs is measured in a child process of its own.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "aes-crypt.h"
+
+#define USAGE "[-n <MiB per measurement>] [-j <threads>[,<threads>...]]"
+
+#define BENCH_KEY "aes-crypt-bench"
+
+/* Bytes each measurement processes at least, and the largest input */
+#define BENCH_TOTAL_MB 256
+#define BENCH_INPUT (16 * 1024 * 1024)
+
+/* A FUSE request's worth of chunks for do_crypt_chunks */
+#define BENCH_BATCH (1024 * 1024)
+
+static const size_t bufsizes[] = { 4096, 65536, AES_CRYPT_BUFSIZE, 1024 * 1024 };
+static const size_t inputs[] = { 4096, 65536, 1024 * 1024, BENCH_INPUT };
+static const int chunk_sizes[] = { 4096, 16384, 65536 };
+static const char* mode_names[AES_CRYPT_NMODES] = { "cbc", "ctr" };
+
+#define NELEM(a) (sizeof(a) / sizeof((a)[0]))
+
+static size_t total_bytes = (size_t) BENCH_TOTAL_MB << 20;
+static unsigned char* plain;
+static unsigned char* cipher;   /* plain encrypted by do_crypt_buf, for decrypt runs */
+static size_t cipher_len;
+static unsigned char* out;
+static unsigned char ivs[BENCH_INPUT / 4096][AES_CRYPT_IVLEN];
+static struct aes_key key;
+static char threads_list[128];
+
+/* Start and end of one measurement */
+struct bench_clock {
+    struct timespec ts;
+    unsigned long long tsc;
+};
+
+static void clock_now(struct bench_clock* c){
+    clock_gettime(CLOCK_MONOTONIC, &c->ts);
+#ifdef HAVE_TSC
+    c->tsc = __rdtsc();
+#else
+    c->tsc = 0;
+#endif
+}
+
+static void size_str(char* buf, size_t len, size_t size){
+    if(size >= 1024 * 1024)
+	snprintf(buf, len, "%zuM", size >> 20);
+    else
+	snprintf(buf, len, "%zuK", size >> 10);
+}
+
+/* Print one line. Cycles are wall-clock TSC cycles, so with several threads
+ * they are cycles of elapsed time per byte, not summed over the threads. */
+static void report(const char* api, const char* mode, int action, size_t size, int threads,
+		   const struct bench_clock* start, const struct bench_clock* end, size_t bytes){
+    double secs = (end->ts.tv_sec - start->ts.tv_sec) + (end->ts.tv_nsec - start->ts.tv_nsec) / 1e9;
+    char sz[16];
+
+    size_str(sz, sizeof(sz), size);
+    printf("%-8s %-4s %-7s %6s %7d %8.2f", api, mode, action ? "encrypt" : "decrypt", sz, threads,
+	   bytes / secs / 1e9);
+#ifdef HAVE_TSC
+    printf(" %11.2f\n", (double) (end->tsc - start->tsc) / bytes);
+#else
+    printf(" %11s\n", "-");
+#endif
+}
+
+/* do_crypt between two fmemopen streams. They have no descriptor, so this is the
+ * fread/fwrite path, run with each buffer size. */
+static int bench_do_crypt(void){
+    struct bench_clock start;
+    struct bench_clock end;
+    size_t done;
+    size_t inlen;
+    FILE* in;
+    FILE* outf;
+    size_t i;
+    int action;
+
+    for(i = 0; i < NELEM(bufsizes); i++){
+	aes_crypt_set_bufsize(bufsizes[i]);
+	for(action = 1; action >= 0; action--){
+	    inlen = action ? BENCH_INPUT : cipher_len;
+	    clock_now(&start);
+	    for(done = 0; done < total_bytes; done += BENCH_INPUT){
+		in = fmemopen(action ? plain : cipher, inlen, "r");
+		outf = fmemopen(out, BENCH_INPUT + AES_BLOCK_SIZE, "w");
+		if(!in || !outf){
+		    perror("fmemopen");
+		    return -1;
+		}
+		if(!do_crypt(in, outf, action, BENCH_KEY)){
+		    fprintf(stderr, "do_crypt failed\n");
+		    return -1;
+		}
+		fclose(in);
+		fclose(outf);
+	    }
+	    clock_now(&end);
+	    report("do_crypt", "cbc", action, bufsizes[i], 1, &start, &end, done);
+	}
+    }
+    aes_crypt_set_bufsize(0);
+    return 0;
+}
+
+/* do_crypt_fd between two memfds, the path do_crypt takes for real files */
+static int bench_fd(void){
+    struct bench_clock start;
+    struct bench_clock end;
+    size_t done;
+    int infd[2];
+    int outfd;
+    size_t i;
+    int action;
+
+    infd[0] = memfd_create("aes-crypt-bench-cipher", 0);
+    infd[1] = memfd_create("aes-crypt-bench-plain", 0);
+    outfd = memfd_create("aes-crypt-bench-out", 0);
+    if(infd[0] == -1 || infd[1] == -1 || outfd == -1){
+	perror("memfd_create");
+	return -1;
+    }
+    if(write(infd[0], cipher, cipher_len) != (ssize_t) cipher_len ||
+       write(infd[1], plain, BENCH_INPUT) != BENCH_INPUT){
+	perror("write");
+	return -1;
+    }
+
+    for(i = 0; i < NELEM(bufsizes); i++){
+	aes_crypt_set_bufsize(bufsizes[i]);
+	for(action = 1; action >= 0; action--){
+	    clock_now(&start);
+	    for(done = 0; done < total_bytes; done += BENCH_INPUT){
+		lseek(infd[action], 0, SEEK_SET);
+		lseek(outfd, 0, SEEK_SET);
+		if(!do_crypt_fd(infd[action], outfd, action, &key)){
+		    fprintf(stderr, "do_crypt_fd failed\n");
+		    return -1;
+		}
+	    }
+	    clock_now(&end);
+	    report("fd", "cbc", action, bufsizes[i], 1, &start, &end, done);
+	}
+    }
+    aes_crypt_set_bufsize(0);
+
+    close(infd[0]);
+    close(infd[1]);
+    close(outfd);
+    return 0;
+}
+
+/* do_crypt_buf on whole inputs of each size */
+static int bench_buf(void){
+    struct bench_clock start;
+    struct bench_clock end;
+    size_t done;
+    size_t outlen;
+    size_t i;
+    int action;
+
+    for(i = 0; i < NELEM(inputs); i++){
+	for(action = 1; action >= 0; action--){
+	    /* A prefix of the ciphertext fails on its padding, so each size
+	     * decrypts the encryption of its own input */
+	    if(!action && !do_crypt_buf(plain, inputs[i], cipher, &cipher_len, 1, &key))
+		return -1;
+	    clock_now(&start);
+	    for(done = 0; done < total_bytes; done += inputs[i]){
+		if(!do_crypt_buf(action ? plain : cipher, action ? inputs[i] : cipher_len,
+				 out, &outlen, action, &key)){
+		    fprintf(stderr, "do_crypt_buf failed\n");
+		    return -1;
+		}
+	    }
+	    clock_now(&end);
+	    report("buf", "cbc", action, inputs[i], 1, &start, &end, done);
+	}
+    }
+    /* The last size is the whole input, whose ciphertext the other runs decrypt */
+    return 0;
+}
+
+/* do_crypt_chunk over the input one chunk at a time, as crypt-file does */
+static int bench_chunk(void){
+    struct bench_clock start;
+    struct bench_clock end;
+    size_t done;
+    size_t off;
+    size_t i;
+    int mode;
+    int action;
+    int cs;
+
+    for(i = 0; i < NELEM(chunk_sizes); i++){
+	cs = chunk_sizes[i];
+	for(mode = 0; mode < AES_CRYPT_NMODES; mode++){
+	    for(action = 1; action >= 0; action--){
+		clock_now(&start);
+		for(done = 0; done < total_bytes; done += BENCH_INPUT){
+		    for(off = 0; off < BENCH_INPUT; off += cs){
+			if(!do_crypt_chunk(plain + off, cs, out + off, action, mode, &key,
+					   ivs[off / cs % NELEM(ivs)])){
+			    fprintf(stderr, "do_crypt_chunk failed\n");
+			    return -1;
+			}
+		    }
+		}
+		clock_now(&end);
+		report("chunk", mode_names[mode], action, cs, 1, &start, &end, done);
+	    }
+	}
+    }
+    return 0;
+}
+
+/* do_crypt_chunks on 1 MiB batches with a pool of threads, in the calling (child) process */
+static int bench_chunks(int threads){
+    struct aes_chunk* chunks;
+    struct bench_clock start;
+    struct bench_clock end;
+    size_t done;
+    size_t batch;
+    size_t i;
+    int n;
+    int c;
+    int mode;
+    int action;
+    int cs;
+
+    aes_crypt_set_workers(threads, 0);
+    chunks = malloc(BENCH_BATCH / 4096 * sizeof(*chunks));
+    if(!chunks)
+	return -1;
+
+    for(i = 0; i < NELEM(chunk_sizes); i++){
+	cs = chunk_sizes[i];
+	n = BENCH_BATCH / cs;
+	for(mode = 0; mode < AES_CRYPT_NMODES; mode++){
+	    for(action = 1; action >= 0; action--){
+		clock_now(&start);
+		for(done = 0; done < total_bytes; done += BENCH_INPUT){
+		    for(batch = 0; batch < BENCH_INPUT; batch += BENCH_BATCH){
+			for(c = 0; c < n; c++){
+			    chunks[c].in = plain + batch + (size_t) c * cs;
+			    chunks[c].out = out + batch + (size_t) c * cs;
+			    chunks[c].len = cs;
+			    chunks[c].iv = ivs[c];
+			}
+			if(!do_crypt_chunks(chunks, n, action, mode, &key)){
+			    fprintf(stderr, "do_crypt_chunks failed\n");
+			    free(chunks);
+			    return -1;
+			}
+		    }
+		}
+		clock_now(&end);
+		report("chunks", mode_names[mode], action, cs, threads, &start, &end, done);
+	    }
+	}
+    }
+    free(chunks);
+    return 0;
+}
+
+int main(int argc, char* argv[]){
+    char* threads_arg = NULL;
+    char* tok;
+    char* save;
+    pid_t pid;
+    int status;
+    int threads;
+    int failed = 0;
+    int opt;
+    size_t i;
+
+    while((opt = getopt(argc, argv, "n:j:")) != -1){
+	switch(opt){
+	case 'n':
+	    total_bytes = (size_t) atol(optarg) << 20;
+	    break;
+	case 'j':
+	    threads_arg = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s %s\n", argv[0], USAGE);
+	    return EXIT_FAILURE;
+	}
+    }
+    if(optind != argc || total_bytes == 0){
+	fprintf(stderr, "usage: %s %s\n", argv[0], USAGE);
+	return EXIT_FAILURE;
+    }
+
+    plain = malloc(BENCH_INPUT);
+    cipher = malloc(BENCH_INPUT + AES_BLOCK_SIZE);
+    out = malloc(BENCH_INPUT + AES_BLOCK_SIZE);
+    if(!plain || !cipher || !out){
+	perror("malloc");
+	return EXIT_FAILURE;
+    }
+    srand(1);
+    for(i = 0; i < BENCH_INPUT; i++)
+	plain[i] = rand();
+    for(i = 0; i < sizeof(ivs); i++)
+	((unsigned char*) ivs)[i] = rand();
+    if(!derive_key(BENCH_KEY, &key))
+	return EXIT_FAILURE;
+
+    printf("%-8s %-4s %-7s %6s %7s %8s %11s\n", "api", "mode", "action", "size", "threads", "GB/s",
+	   "cycles/byte");
+
+    if(bench_buf() || bench_do_crypt() || bench_fd() || bench_chunk())
+	return EXIT_FAILURE;
+    fflush(stdout);
+
+    /* One process per pool size: by default 1, 2, 4, ... and the number of CPUs */
+    if(!threads_arg){
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t len = 0;
+
+	for(threads = 1; threads < cpus; threads *= 2)
+	    len += snprintf(threads_list + len, sizeof(threads_list) - len, "%d,", threads);
+	snprintf(threads_list + len, sizeof(threads_list) - len, "%ld", cpus > 1 ? cpus : 1L);
+	threads_arg = threads_list;
+    }
+    for(tok = strtok_r(threads_arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)){
+	threads = atoi(tok);
+	if(threads < 1)
+	    continue;
+	pid = fork();
+	if(pid == -1){
+	    perror("fork");
+	    return EXIT_FAILURE;
+	}
+	if(pid == 0){
+	    status = bench_chunks(threads);
+	    fflush(stdout);
+	    _exit(status ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status))
+	    failed = 1;
+    }
+
+    free(plain);
+    free(cipher);
+    free(out);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
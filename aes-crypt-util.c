@@ -9,12 +9,313 @@
  *
  */
 
+#define _XOPEN_SOURCE 700
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "aes-crypt.h"
 
+#define BULK_USAGE "-b <-e|-d> <key phrase> [-j <threads>] <in path> <out path> [<in path> <out path> ...]\n" \
+    "       -b -c [-j <threads>] <in path> <out path> [<in path> <out path> ...]\n" \
+    "       (an in path that is a directory is processed recursively into its out path)"
+
+/* One file of a bulk run */
+struct bulk_job {
+    char* in;
+    char* out;
+};
+
+/* Output directory of a bulk run, created writable and given its source
+ * directory's mode once every file in it is written */
+struct bulk_dir {
+    char* path;
+    mode_t mode;
+};
+
+/* Shared state of a bulk run. Workers take jobs in order under lock. */
+struct bulk_state {
+    pthread_mutex_t lock;
+    struct bulk_job* jobs;
+    size_t njobs;
+    size_t cap;
+    size_t next;
+    int action;
+    struct aes_key key;
+    unsigned long long bytes;   /* input bytes processed */
+    int failed;
+    struct bulk_dir* dirs;      /* in the order nftw created them, parents first */
+    size_t ndirs;
+    size_t dircap;
+    /* Directory being walked by nftw, which has no user data pointer */
+    const char* walk_in;
+    const char* walk_out;
+};
+
+static struct bulk_state bulk = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, {{0}, {0}}, 0, 0, NULL, 0, 0, NULL, NULL };
+
+static double now_sec(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bulk_add(const char* in, const char* out){
+    struct bulk_job* jobs;
+
+    if(bulk.njobs == bulk.cap){
+	bulk.cap = bulk.cap ? bulk.cap * 2 : 64;
+	jobs = realloc(bulk.jobs, bulk.cap * sizeof(*jobs));
+	if(!jobs)
+	    return -1;
+	bulk.jobs = jobs;
+    }
+    bulk.jobs[bulk.njobs].in = strdup(in);
+    bulk.jobs[bulk.njobs].out = strdup(out);
+    if(!bulk.jobs[bulk.njobs].in || !bulk.jobs[bulk.njobs].out)
+	return -1;
+    bulk.njobs++;
+    return 0;
+}
+
+static int bulk_add_dir(const char* path, mode_t mode){
+    struct bulk_dir* dirs;
+
+    if(bulk.ndirs == bulk.dircap){
+	bulk.dircap = bulk.dircap ? bulk.dircap * 2 : 16;
+	dirs = realloc(bulk.dirs, bulk.dircap * sizeof(*dirs));
+	if(!dirs)
+	    return -1;
+	bulk.dirs = dirs;
+    }
+    bulk.dirs[bulk.ndirs].path = strdup(path);
+    if(!bulk.dirs[bulk.ndirs].path)
+	return -1;
+    bulk.dirs[bulk.ndirs].mode = mode;
+    bulk.ndirs++;
+    return 0;
+}
+
+/* nftw callback: mirror directories now, queue regular files. Directories
+ * are made writable by us so a read-only source tree can still be filled in;
+ * bulk_main gives them their source mode when the workers are done. */
+static int bulk_walk(const char* path, const struct stat* st, int type, struct FTW* ftw){
+    char out[PATH_MAX];
+
+    (void) ftw;
+    if(snprintf(out, sizeof(out), "%s%s", bulk.walk_out, path + strlen(bulk.walk_in)) >= (int) sizeof(out)){
+	fprintf(stderr, "%s: path too long\n", path);
+	return -1;
+    }
+
+    if(type == FTW_D){
+	if(mkdir(out, (st->st_mode & 07777) | S_IRWXU) == 0){
+	    if(bulk_add_dir(out, st->st_mode & 07777))
+		return -1;
+	}
+	else if(errno != EEXIST){
+	    perror(out);
+	    return -1;
+	}
+    }
+    else if(type == FTW_F && S_ISREG(st->st_mode)){
+	if(bulk_add(path, out))
+	    return -1;
+    }
+    else if(type == FTW_DNR || type == FTW_NS){
+	fprintf(stderr, "%s: cannot read, skipped\n", path);
+    }
+    return 0;
+}
+
+/* Run one file, returns its input size or -1 */
+static long long bulk_file(const struct bulk_job* job){
+    struct stat st;
+    int infd;
+    int outfd;
+    int ok;
+
+    infd = open(job->in, O_RDONLY);
+    if(infd == -1){
+	perror(job->in);
+	return -1;
+    }
+    if(fstat(infd, &st) == -1){
+	perror(job->in);
+	close(infd);
+	return -1;
+    }
+    outfd = open(job->out, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if(outfd == -1){
+	perror(job->out);
+	close(infd);
+	return -1;
+    }
+
+    ok = do_crypt_fd(infd, outfd, bulk.action, &bulk.key);
+    if(close(outfd) == -1){
+	perror(job->out);
+	ok = 0;
+    }
+    close(infd);
+
+    if(!ok){
+	fprintf(stderr, "%s: do_crypt failed\n", job->in);
+	return -1;
+    }
+    return st.st_size;
+}
+
+static void* bulk_worker(void* arg){
+    struct bulk_job* job;
+    long long size;
+    double start;
+    double secs;
+
+    (void) arg;
+    for(;;){
+	pthread_mutex_lock(&bulk.lock);
+	job = bulk.next < bulk.njobs ? &bulk.jobs[bulk.next++] : NULL;
+	pthread_mutex_unlock(&bulk.lock);
+	if(!job)
+	    return NULL;
+
+	start = now_sec();
+	size = bulk_file(job);
+	secs = now_sec() - start;
+
+	pthread_mutex_lock(&bulk.lock);
+	if(size < 0){
+	    bulk.failed++;
+	}
+	else{
+	    bulk.bytes += size;
+	    printf("%s: %lld bytes in %.3f s, %.1f MB/s\n", job->in, size, secs,
+		   secs > 0 ? size / secs / 1e6 : 0.0);
+	}
+	pthread_mutex_unlock(&bulk.lock);
+    }
+}
+
+/* aes-crypt-util -b ...: encrypt, decrypt or copy many files or trees concurrently */
+static int bulk_main(int argc, char** argv){
+    pthread_t* threads;
+    struct stat st;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char* key_str = NULL;
+    double start;
+    double secs;
+    int arg = 3;
+    long i;
+
+    if(argc < 3){
+	fprintf(stderr, "usage: %s %s\n", argv[0], BULK_USAGE);
+	return EXIT_FAILURE;
+    }
+    if(!strcmp(argv[2], "-e") || !strcmp(argv[2], "-d")){
+	bulk.action = !strcmp(argv[2], "-e");
+	if(argc < 4){
+	    fprintf(stderr, "usage: %s %s\n", argv[0], BULK_USAGE);
+	    return EXIT_FAILURE;
+	}
+	key_str = argv[3];
+	arg = 4;
+    }
+    else if(!strcmp(argv[2], "-c")){
+	bulk.action = -1;
+    }
+    else{
+	fprintf(stderr, "Unkown action\n");
+	return EXIT_FAILURE;
+    }
+    if(arg + 1 < argc && !strcmp(argv[arg], "-j")){
+	nthreads = atol(argv[arg + 1]);
+	arg += 2;
+    }
+    if(nthreads < 1)
+	nthreads = 1;
+    if(arg >= argc || (argc - arg) % 2){
+	fprintf(stderr, "usage: %s %s\n", argv[0], BULK_USAGE);
+	return EXIT_FAILURE;
+    }
+
+    /* Derive the key once for every file */
+    if(bulk.action >= 0 && !derive_key(key_str, &bulk.key))
+	return EXIT_FAILURE;
+
+    /* Collect the files first so workers only ever take from a finished list */
+    for(; arg < argc; arg += 2){
+	if(stat(argv[arg], &st) == -1){
+	    perror(argv[arg]);
+	    return EXIT_FAILURE;
+	}
+	if(S_ISDIR(st.st_mode)){
+	    bulk.walk_in = argv[arg];
+	    bulk.walk_out = argv[arg + 1];
+	    if(nftw(argv[arg], bulk_walk, 64, FTW_PHYS))
+		return EXIT_FAILURE;
+	}
+	else if(bulk_add(argv[arg], argv[arg + 1])){
+	    perror("bulk_add");
+	    return EXIT_FAILURE;
+	}
+    }
+
+    if((size_t) nthreads > bulk.njobs)
+	nthreads = bulk.njobs ? bulk.njobs : 1;
+    threads = malloc(nthreads * sizeof(*threads));
+    if(!threads){
+	perror("malloc");
+	return EXIT_FAILURE;
+    }
+
+    start = now_sec();
+    for(i = 0; i < nthreads; i++){
+	if(pthread_create(&threads[i], NULL, bulk_worker, NULL)){
+	    fprintf(stderr, "pthread_create failed\n");
+	    nthreads = i;
+	    break;
+	}
+    }
+    /* With no thread started this one does the work */
+    if(nthreads == 0)
+	bulk_worker(NULL);
+    for(i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    secs = now_sec() - start;
+
+    /* Children before parents, a parent's mode may not let us reach them */
+    for(i = (long) bulk.ndirs - 1; i >= 0; i--){
+	if(chmod(bulk.dirs[i].path, bulk.dirs[i].mode) == -1){
+	    perror(bulk.dirs[i].path);
+	    bulk.failed++;
+	}
+	free(bulk.dirs[i].path);
+    }
+    free(bulk.dirs);
+
+    printf("total: %zu files, %llu bytes in %.3f s, %.1f MB/s, %d failed\n",
+	   bulk.njobs, bulk.bytes, secs, secs > 0 ? bulk.bytes / secs / 1e6 : 0.0, bulk.failed);
+
+    for(i = 0; i < (long) bulk.njobs; i++){
+	free(bulk.jobs[i].in);
+	free(bulk.jobs[i].out);
+    }
+    free(bulk.jobs);
+    free(threads);
+    return bulk.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
     
@@ -30,9 +331,15 @@ int main(int argc, char **argv)
     if(argc < 3){
 	fprintf(stderr, "usage: %s %s\n", argv[0],
 		"<type> <opt key phrase> <in path> <out path>");
+	fprintf(stderr, "       %s %s\n", argv[0], BULK_USAGE);
 	exit(EXIT_FAILURE);
     }
 
+    /* Bulk Case */
+    if(!strcmp(argv[1], "-b")){
+	return bulk_main(argc, argv);
+    }
+
     /* Encrypt Case */
     if(!strcmp(argv[1], "-e")){
 	/* Check Args */
@@ -15,100 +15,706 @@
  *
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include "aes-crypt.h"
 
-#define BLOCKSIZE 1024
-#define FAILURE 0
-#define SUCCESS 1
+#define NROUNDS 5
+
+/* Worker pool defaults: one thread per CPU up to AES_POOL_MAX, batches from 128 KiB */
+#define AES_POOL_MAX 64
+#define AES_POOL_THRESHOLD (128 * 1024)
+/* do_decrypt_fd splits whole-file CBC ranges into pieces of this size */
+#define AES_CBC_SEGMENT (64 * 1024)
+
+/* Cipher contexts owned by one thread. ctx[mode][action] stays keyed with
+ * key[mode] so chunk calls only load a new IV instead of re-running key setup. */
+struct aes_thread_ctx {
+    EVP_CIPHER_CTX* ctx[AES_CRYPT_NMODES][2];
+    int keyed[AES_CRYPT_NMODES];
+    unsigned char key[AES_CRYPT_NMODES][AES_CRYPT_KEYLEN];
+};
+
+static pthread_key_t thread_ctx_key;
+static pthread_once_t thread_ctx_once = PTHREAD_ONCE_INIT;
+
+static void thread_ctx_free(void* arg){
+    struct aes_thread_ctx* tc = arg;
+    int m;
+
+    for(m = 0; m < AES_CRYPT_NMODES; m++){
+	EVP_CIPHER_CTX_free(tc->ctx[m][0]);
+	EVP_CIPHER_CTX_free(tc->ctx[m][1]);
+    }
+    free(tc);
+}
+
+static const EVP_CIPHER* mode_cipher(int mode){
+    return mode == AES_CRYPT_CTR ? EVP_aes_256_ctr() : EVP_aes_256_cbc();
+}
+
+static void thread_ctx_init(void){
+    pthread_key_create(&thread_ctx_key, thread_ctx_free);
+}
+
+/* Get the calling thread's contexts, creating them on first use */
+static struct aes_thread_ctx* thread_ctx(void){
+    struct aes_thread_ctx* tc;
+    int m;
+
+    pthread_once(&thread_ctx_once, thread_ctx_init);
+    tc = pthread_getspecific(thread_ctx_key);
+    if(tc)
+	return tc;
+
+    tc = calloc(1, sizeof(*tc));
+    if(!tc)
+	return NULL;
+    for(m = 0; m < AES_CRYPT_NMODES; m++){
+	tc->ctx[m][0] = EVP_CIPHER_CTX_new();
+	tc->ctx[m][1] = EVP_CIPHER_CTX_new();
+	if(!tc->ctx[m][0] || !tc->ctx[m][1]){
+	    thread_ctx_free(tc);
+	    return NULL;
+	}
+    }
+    if(pthread_setspecific(thread_ctx_key, tc)){
+	thread_ctx_free(tc);
+	return NULL;
+    }
+    return tc;
+}
+
+/* Plaintext bytes encrypted ([1]) and ciphertext bytes decrypted ([0]) */
+static unsigned long long crypt_bytes[2];
+
+static void crypt_count(int action, size_t len){
+    __atomic_fetch_add(&crypt_bytes[action ? 1 : 0], len, __ATOMIC_RELAXED);
+}
+
+extern void aes_crypt_get_stats(struct aes_crypt_stats* st){
+    st->encrypted = __atomic_load_n(&crypt_bytes[1], __ATOMIC_RELAXED);
+    st->decrypted = __atomic_load_n(&crypt_bytes[0], __ATOMIC_RELAXED);
+}
+
+/* A batch submitted to the pool. It lives on the submitter's stack; workers only
+ * touch it under pool.lock and the submitter waits for pending to reach 0. */
+struct crypt_batch {
+    const struct aes_chunk* chunks;
+    int n;
+    int action;
+    int mode;
+    const struct aes_key* key;
+    int next;                   /* next chunk to claim */
+    int step;                   /* chunks claimed at a time */
+    int pending;                /* chunks not finished yet */
+    int failed;
+    struct crypt_batch* qnext;
+    pthread_cond_t done;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct crypt_batch* head;   /* batches with chunks left to claim */
+    struct crypt_batch* tail;
+    int threads;                /* including the submitting thread */
+    size_t threshold;
+    int started;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL,
+    0, AES_POOL_THRESHOLD, 0
+};
+
+/* Claim the next run of chunks of b, taking b off the queue once all are claimed.
+ * Called with pool.lock held. Returns the number claimed, 0 if none are left. */
+static int batch_claim(struct crypt_batch* b, int* first){
+    int count = b->n - b->next < b->step ? b->n - b->next : b->step;
+    struct crypt_batch** pp;
+
+    *first = b->next;
+    b->next += count;
+    if(b->next == b->n){
+	for(pp = &pool.head; *pp && *pp != b; pp = &(*pp)->qnext)
+	    ;
+	if(*pp){
+	    *pp = b->qnext;
+	    if(pool.tail == b){
+		pool.tail = NULL;
+		for(pp = &pool.head; *pp; pp = &(*pp)->qnext)
+		    pool.tail = *pp;
+	    }
+	}
+    }
+    return count;
+}
+
+/* Run claimed chunks without the lock, then report them done. Called and returns with pool.lock held. */
+static void batch_run(struct crypt_batch* b, int first, int count){
+    int ok = 1;
+    int i;
+
+    pthread_mutex_unlock(&pool.lock);
+    for(i = first; i < first + count; i++){
+	const struct aes_chunk* c = &b->chunks[i];
+	if(!do_crypt_chunk(c->in, c->len, c->out, b->action, b->mode, b->key, c->iv))
+	    ok = 0;
+    }
+    pthread_mutex_lock(&pool.lock);
+
+    if(!ok)
+	b->failed = 1;
+    b->pending -= count;
+    if(b->pending == 0)
+	pthread_cond_signal(&b->done);
+}
+
+static void* pool_worker(void* arg){
+    struct crypt_batch* b;
+    int first;
+    int count;
+
+    (void) arg;
+    pthread_mutex_lock(&pool.lock);
+    for(;;){
+	while(!pool.head)
+	    pthread_cond_wait(&pool.work, &pool.lock);
+	b = pool.head;
+	count = batch_claim(b, &first);
+	batch_run(b, first, count);
+    }
+    return NULL;
+}
+
+/* Start the worker threads on first use. Called with pool.lock held.
+ * Returns the number of threads that can work on a batch, caller included. */
+static int pool_start(void){
+    pthread_t tid;
+    long cpus;
+    int i;
+
+    if(pool.started)
+	return pool.threads;
+    pool.started = 1;
+
+    if(pool.threads <= 0){
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pool.threads = cpus < 1 ? 1 : cpus > AES_POOL_MAX ? AES_POOL_MAX : (int) cpus;
+    }
+    for(i = 1; i < pool.threads; i++){
+	if(pthread_create(&tid, NULL, pool_worker, NULL)){
+	    fprintf(stderr, "Could only start %d of %d crypto workers\n", i - 1, pool.threads - 1);
+	    pool.threads = i;
+	    break;
+	}
+	pthread_detach(tid);
+    }
+    return pool.threads;
+}
+
+extern void aes_crypt_set_workers(int threads, size_t threshold){
+    pthread_mutex_lock(&pool.lock);
+    if(!pool.started){
+	pool.threads = threads > AES_POOL_MAX ? AES_POOL_MAX : threads;
+	pool.threshold = threshold;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+extern int do_crypt_chunks(const struct aes_chunk* chunks, int n, int action, int mode,
+			   const struct aes_key* key){
+    struct crypt_batch b;
+    size_t total = 0;
+    int threads;
+    int first;
+    int count;
+    int i;
+
+    for(i = 0; i < n; i++)
+	total += chunks[i].len;
+
+    pthread_mutex_lock(&pool.lock);
+    threads = total >= pool.threshold && n > 1 ? pool_start() : 1;
+    pthread_mutex_unlock(&pool.lock);
+
+    if(threads <= 1){
+	for(i = 0; i < n; i++){
+	    if(!do_crypt_chunk(chunks[i].in, chunks[i].len, chunks[i].out,
+			       action, mode, key, chunks[i].iv))
+		return FAILURE;
+	}
+	return SUCCESS;
+    }
+
+    b.chunks = chunks;
+    b.n = n;
+    b.action = action;
+    b.mode = mode;
+    b.key = key;
+    b.next = 0;
+    /* Claim a few chunks at a time so small chunks do not spend their time on the lock */
+    b.step = n / (threads * 4) > 1 ? n / (threads * 4) : 1;
+    b.pending = n;
+    b.failed = 0;
+    b.qnext = NULL;
+    pthread_cond_init(&b.done, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    if(pool.tail)
+	pool.tail->qnext = &b;
+    else
+	pool.head = &b;
+    pool.tail = &b;
+    pthread_cond_broadcast(&pool.work);
+
+    /* Work on our own batch rather than sleep */
+    while(b.next < b.n){
+	count = batch_claim(&b, &first);
+	batch_run(&b, first, count);
+    }
+    while(b.pending > 0)
+	pthread_cond_wait(&b.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_cond_destroy(&b.done);
+    return b.failed ? FAILURE : SUCCESS;
+}
+
+extern int derive_key(const char* key_str, struct aes_key* key){
+    int i;
+
+    if(!key_str){
+	/* Error */
+	fprintf(stderr, "Key_str must not be NULL\n");
+	return FAILURE;
+    }
+    /* Build Key from String */
+    i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
+		       (unsigned char*)key_str, strlen(key_str), NROUNDS, key->key, key->iv);
+    if (i != AES_CRYPT_KEYLEN) {
+	/* Error */
+	fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
+	return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+extern int do_crypt_chunk(const unsigned char* in, int inlen, unsigned char* out,
+			  int action, int mode, const struct aes_key* key, const unsigned char* iv){
+    struct aes_thread_ctx* tc;
+    EVP_CIPHER_CTX* ctx;
+    int outlen;
+    int finlen;
+
+    if(inlen % AES_BLOCK_SIZE){
+	fprintf(stderr, "Chunk length %d is not a multiple of the AES block size\n", inlen);
+	return FAILURE;
+    }
+
+    if(mode < 0 || mode >= AES_CRYPT_NMODES){
+	fprintf(stderr, "Unknown cipher mode %d\n", mode);
+	return FAILURE;
+    }
+
+    tc = thread_ctx();
+    if(!tc){
+	return FAILURE;
+    }
+    ctx = tc->ctx[mode][action ? 1 : 0];
+
+    /* Run the key schedule only when this thread last used a different key */
+    if(!tc->keyed[mode] || memcmp(tc->key[mode], key->key, AES_CRYPT_KEYLEN)){
+	tc->keyed[mode] = 0;
+	if(!EVP_CipherInit_ex(tc->ctx[mode][0], mode_cipher(mode), NULL, key->key, NULL, 0) ||
+	   !EVP_CipherInit_ex(tc->ctx[mode][1], mode_cipher(mode), NULL, key->key, NULL, 1)){
+	    return FAILURE;
+	}
+	memcpy(tc->key[mode], key->key, AES_CRYPT_KEYLEN);
+	tc->keyed[mode] = 1;
+    }
+
+    /* Chunks are zero padded by the caller, so no PKCS padding block is added */
+    if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, action ? 1 : 0) ||
+       !EVP_CIPHER_CTX_set_padding(ctx, 0) ||
+       !EVP_CipherUpdate(ctx, out, &outlen, in, inlen) ||
+       !EVP_CipherFinal_ex(ctx, out + outlen, &finlen)){
+	return FAILURE;
+    }
+
+    crypt_count(action, inlen);
+    return SUCCESS;
+}
+
+/* Set up the calling thread's context for a whole-stream cipher in the
+ * do_crypt format: derived IV and PKCS padding */
+static EVP_CIPHER_CTX* stream_ctx(int action, const struct aes_key* key){
+    struct aes_thread_ctx* tc;
+    EVP_CIPHER_CTX* ctx;
+
+    tc = thread_ctx();
+    if(!tc){
+	return NULL;
+    }
+    /* The context no longer matches the chunk setup afterwards */
+    tc->keyed[AES_CRYPT_CBC] = 0;
+    ctx = tc->ctx[AES_CRYPT_CBC][action ? 1 : 0];
+    if(!EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->key, key->iv, action ? 1 : 0) ||
+       !EVP_CIPHER_CTX_set_padding(ctx, 1)){
+	return NULL;
+    }
+    return ctx;
+}
+
+extern int do_crypt_buf(const unsigned char* in, size_t inlen, unsigned char* out,
+			size_t* outlen, int action, const struct aes_key* key){
+    EVP_CIPHER_CTX* ctx;
+    int updlen;
+    int finlen;
+
+    /* Pass-through mode, copy buffer as is */
+    if(action < 0){
+	memmove(out, in, inlen);
+	*outlen = inlen;
+	return SUCCESS;
+    }
+
+    if(inlen > INT_MAX - AES_BLOCK_SIZE){
+	return FAILURE;
+    }
+
+    ctx = stream_ctx(action, key);
+    if(!ctx){
+	return FAILURE;
+    }
+    if(!EVP_CipherUpdate(ctx, out, &updlen, in, inlen) ||
+       !EVP_CipherFinal_ex(ctx, out + updlen, &finlen)){
+	return FAILURE;
+    }
+
+    crypt_count(action, inlen);
+    *outlen = updlen + finlen;
+    return SUCCESS;
+}
+
+/* Decrypt CBC ciphertext in place. Every block only needs the ciphertext block
+ * before it, so large ranges are cut into segments decrypted in parallel; the
+ * segment IVs are saved first since decrypting in place overwrites them. */
+static int cbc_decrypt_range(unsigned char* buf, size_t len, const unsigned char* iv,
+			     const struct aes_key* key){
+    struct aes_chunk* segs;
+    unsigned char* ivs;
+    size_t nsegs = (len + AES_CBC_SEGMENT - 1) / AES_CBC_SEGMENT;
+    size_t i;
+    int res;
+
+    if(nsegs <= 1 || nsegs > INT_MAX)
+	return do_crypt_chunk(buf, len, buf, 0, AES_CRYPT_CBC, key, iv);
+
+    segs = malloc(nsegs * sizeof(*segs));
+    ivs = malloc(nsegs * AES_CRYPT_IVLEN);
+    if(!segs || !ivs){
+	free(segs);
+	free(ivs);
+	return do_crypt_chunk(buf, len, buf, 0, AES_CRYPT_CBC, key, iv);
+    }
+
+    memcpy(ivs, iv, AES_CRYPT_IVLEN);
+    for(i = 0; i < nsegs; i++){
+	size_t start = i * AES_CBC_SEGMENT;
+	if(i > 0)
+	    memcpy(ivs + i * AES_CRYPT_IVLEN, buf + start - AES_CRYPT_IVLEN, AES_CRYPT_IVLEN);
+	segs[i].in = buf + start;
+	segs[i].out = buf + start;
+	segs[i].len = len - start < AES_CBC_SEGMENT ? len - start : AES_CBC_SEGMENT;
+	segs[i].iv = ivs + i * AES_CRYPT_IVLEN;
+    }
+
+    res = do_crypt_chunks(segs, nsegs, 0, AES_CRYPT_CBC, key);
+    free(segs);
+    free(ivs);
+    return res;
+}
+
+/* Bytes moved per read/EVP_CipherUpdate/write by the streaming calls */
+static size_t io_bufsize = AES_CRYPT_BUFSIZE;
+
+extern void aes_crypt_set_bufsize(size_t size){
+    if(size == 0)
+	size = AES_CRYPT_BUFSIZE;
+    if(size > AES_CRYPT_BUFSIZE_MAX)
+	size = AES_CRYPT_BUFSIZE_MAX;
+    io_bufsize = (size + AES_CRYPT_ALIGN - 1) & ~((size_t) AES_CRYPT_ALIGN - 1);
+}
+
+/* Allocate the aligned in/out buffer pair of a streaming call. The output side
+ * has room for the extra cipher block EVP_CipherUpdate may produce. */
+static int io_buffers(unsigned char** inbuf, unsigned char** outbuf){
+    *inbuf = NULL;
+    *outbuf = NULL;
+    if(posix_memalign((void**) inbuf, AES_CRYPT_ALIGN, io_bufsize) ||
+       posix_memalign((void**) outbuf, AES_CRYPT_ALIGN, io_bufsize + EVP_MAX_BLOCK_LENGTH)){
+	perror("do_crypt buffer");
+	free(*inbuf);
+	*inbuf = NULL;
+	return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/* write all len bytes, retrying short writes */
+static int write_full(int fd, const unsigned char* buf, size_t len){
+    ssize_t res;
+
+    while(len > 0){
+	res = write(fd, buf, len);
+	if(res == -1){
+	    if(errno == EINTR)
+		continue;
+	    return FAILURE;
+	}
+	buf += res;
+	len -= res;
+    }
+    return SUCCESS;
+}
+
+extern int do_crypt_fd(int infd, int outfd, int action, const struct aes_key* key){
+    EVP_CIPHER_CTX* ctx = NULL;
+    unsigned char* inbuf = NULL;
+    unsigned char* outbuf = NULL;
+    ssize_t inlen;
+    int outlen;
+    int res = FAILURE;
+
+    if(!io_buffers(&inbuf, &outbuf))
+	goto out;
+
+    if(action >= 0){
+	ctx = stream_ctx(action, key);
+	if(!ctx)
+	    goto out;
+    }
+
+    for(;;){
+	inlen = read(infd, inbuf, io_bufsize);
+	if(inlen == -1){
+	    if(errno == EINTR)
+		continue;
+	    perror("read error");
+	    goto out;
+	}
+	if(inlen == 0)
+	    break;
+
+	if(action >= 0){
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen))
+		goto out;
+	    crypt_count(action, inlen);
+	    if(!write_full(outfd, outbuf, outlen)){
+		perror("write error");
+		goto out;
+	    }
+	}
+	/* Pass-through mode, write the block as is */
+	else if(!write_full(outfd, inbuf, inlen)){
+	    perror("write error");
+	    goto out;
+	}
+    }
+
+    /* Remaining cipher block + padding */
+    if(action >= 0){
+	if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen) || !write_full(outfd, outbuf, outlen))
+	    goto out;
+    }
+    res = SUCCESS;
+
+out:
+    free(inbuf);
+    free(outbuf);
+    return res;
+}
+
+extern ssize_t do_decrypt_fd(int fd, off_t offset, unsigned char* out, size_t len,
+			     const struct aes_key* key){
+    unsigned char iv[AES_CRYPT_IVLEN];
+    size_t done = 0;
+    ssize_t res;
+
+    if(offset % AES_BLOCK_SIZE || len % AES_BLOCK_SIZE){
+	return -EINVAL;
+    }
+
+    /* In CBC the IV of each block is the ciphertext block before it */
+    if(offset == 0){
+	memcpy(iv, key->iv, AES_CRYPT_IVLEN);
+    }
+    else if(pread(fd, iv, AES_CRYPT_IVLEN, offset - AES_CRYPT_IVLEN) != AES_CRYPT_IVLEN){
+	return -EIO;
+    }
+
+    while(done < len){
+	res = pread(fd, out + done, len - done, offset + done);
+	if(res == -1){
+	    if(errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	if(res == 0)
+	    break;
+	done += res;
+    }
+
+    done &= ~((size_t) AES_BLOCK_SIZE - 1);
+    if(done && !cbc_decrypt_range(out, done, iv, key)){
+	return -EIO;
+    }
+    return done;
+}
+
+extern off_t do_crypt_plain_size(int fd, const struct aes_key* key){
+    unsigned char last[AES_BLOCK_SIZE];
+    struct stat st;
+    int pad;
+    int i;
+
+    if(fstat(fd, &st) == -1){
+	return -errno;
+    }
+    if(st.st_size < AES_BLOCK_SIZE || st.st_size % AES_BLOCK_SIZE){
+	return -EINVAL;
+    }
+
+    /* Only the final block has to be decrypted to read the padding length */
+    if(do_decrypt_fd(fd, st.st_size - AES_BLOCK_SIZE, last, AES_BLOCK_SIZE, key) != AES_BLOCK_SIZE){
+	return -EIO;
+    }
+    pad = last[AES_BLOCK_SIZE - 1];
+    if(pad < 1 || pad > AES_BLOCK_SIZE){
+	return -EINVAL;
+    }
+    for(i = AES_BLOCK_SIZE - pad; i < AES_BLOCK_SIZE; i++){
+	if(last[i] != pad){
+	    return -EINVAL;
+	}
+    }
+
+    return st.st_size - pad;
+}
 
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str){
+    struct aes_key key;
+
+    /* Setup Encryption Key if in cipher mode */
+    if(action >= 0 && !derive_key(key_str, &key)){
+	/* Error */
+	return FAILURE;
+    }
+
+    return do_crypt_key(in, out, action, &key);
+}
+
+/* Non-zero if f has nothing buffered, i.e. its position is its descriptor's
+ * offset. Unseekable streams (pipes) can't tell, so they answer no. */
+static int stream_at_fd(FILE* f, int fd){
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+
+    return pos != -1 && ftello(f) == pos;
+}
+
+extern int do_crypt_key(FILE* in, FILE* out, int action, const struct aes_key* key){
     /* Local Vars */
+    int infd = fileno(in);
+    int outfd = fileno(out);
 
     /* Buffers */
-    unsigned char inbuf[BLOCKSIZE];
-    int inlen;
+    unsigned char* inbuf;
+    size_t inlen;
     /* Allow enough space in output buffer for additional cipher block */
-    unsigned char outbuf[BLOCKSIZE + EVP_MAX_BLOCK_LENGTH];
+    unsigned char* outbuf;
     int outlen;
-    int writelen;
+    int res = FAILURE;
 
     /* OpenSSL libcrypto vars */
-    EVP_CIPHER_CTX ctx;
-    unsigned char key[32];
-    unsigned char iv[32];
-    int nrounds = 5;
-    
-    /* tmp vars */
-    int i;
+    EVP_CIPHER_CTX* ctx = NULL;
 
-    /* Setup Encryption Key and Cipher Engine if in cipher mode */
-    if(action >= 0){
-	if(!key_str){
-	    /* Error */
-	    fprintf(stderr, "Key_str must not be NULL\n");
-	    return 0;
+    /* Streams on real files skip stdio entirely, but only when nothing is
+     * buffered: out is flushed first, and in must not have read ahead of
+     * its descriptor (fflush on an input stream is not portable). */
+    if(infd != -1 && outfd != -1){
+	if(fflush(out)){
+	    perror("fflush error");
+	    return FAILURE;
 	}
-	/* Build Key from String */
-	i = EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), NULL,
-			   (unsigned char*)key_str, strlen(key_str), nrounds, key, iv);
-	if (i != 32) {
-	    /* Error */
-	    fprintf(stderr, "Key size is %d bits - should be 256 bits\n", i*8);
-	    return 0;
+	if(stream_at_fd(in, infd) && stream_at_fd(out, outfd))
+	    return do_crypt_fd(infd, outfd, action, key);
+    }
+
+    if(!io_buffers(&inbuf, &outbuf)){
+	return FAILURE;
+    }
+
+    /* Setup Cipher Engine if in cipher mode */
+    if(action >= 0){
+	ctx = stream_ctx(action, key);
+	if(!ctx){
+	    goto out;
 	}
-	/* Init Engine */
-	EVP_CIPHER_CTX_init(&ctx);
-	EVP_CipherInit_ex(&ctx, EVP_aes_256_cbc(), NULL, key, iv, action);
-    }    
+    }
 
     /* Loop through Input File*/
     for(;;){
 	/* Read Block */
-	inlen = fread(inbuf, sizeof(*inbuf), BLOCKSIZE, in);
-	if(inlen <= 0){
+	inlen = fread(inbuf, sizeof(*inbuf), io_bufsize, in);
+	if(inlen == 0){
 	    /* EOF -> Break Loop */
+	    if(ferror(in)){
+		perror("fread error");
+		goto out;
+	    }
 	    break;
 	}
-	
+
 	/* If in cipher mode, perform cipher transform on block */
 	if(action >= 0){
-	    if(!EVP_CipherUpdate(&ctx, outbuf, &outlen, inbuf, inlen))
-		{
-		    /* Error */
-		    EVP_CIPHER_CTX_cleanup(&ctx);
-		    return 0;
-		}
-	}
-	/* If in pass-through mode. copy block as is */
-	else{
-	    memcpy(outbuf, inbuf, inlen);
-	    outlen = inlen;
-	}
-
-	/* Write Block */
-	writelen = fwrite(outbuf, sizeof(*outbuf), outlen, out);
-	if(writelen != outlen){
-	    /* Error */
+	    if(!EVP_CipherUpdate(ctx, outbuf, &outlen, inbuf, inlen)){
+		/* Error */
+		goto out;
+	    }
+	    crypt_count(action, inlen);
+	    /* Write Block */
+	    if(fwrite(outbuf, sizeof(*outbuf), outlen, out) != (size_t) outlen){
+		perror("fwrite error");
+		goto out;
+	    }
+	}
+	/* If in pass-through mode. write block as is */
+	else if(fwrite(inbuf, sizeof(*inbuf), inlen, out) != inlen){
 	    perror("fwrite error");
-	    EVP_CIPHER_CTX_cleanup(&ctx);
-	    return 0;
+	    goto out;
 	}
     }
-    
+
     /* If in cipher mode, handle necessary padding */
     if(action >= 0){
-	/* Handle remaining cipher block + padding */
-	if(!EVP_CipherFinal_ex(&ctx, outbuf, &outlen))
-	    {
-		/* Error */
-		EVP_CIPHER_CTX_cleanup(&ctx);
-		return 0;
-	    }
-	/* Write remainign cipher block + padding*/
-	fwrite(outbuf, sizeof(*inbuf), outlen, out);
-	EVP_CIPHER_CTX_cleanup(&ctx);
+	/* Handle and write remaining cipher block + padding */
+	if(!EVP_CipherFinal_ex(ctx, outbuf, &outlen) ||
+	   fwrite(outbuf, sizeof(*outbuf), outlen, out) != (size_t) outlen){
+	    /* Error */
+	    goto out;
+	}
     }
-    
+
     /* Success */
-    return 1;
+    res = SUCCESS;
+
+out:
+    free(inbuf);
+    free(outbuf);
+    return res;
 }
@@ -21,22 +21,180 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
 
 #include <openssl/evp.h>
 #include <openssl/aes.h>
 
-#define BLOCKSIZE 1024
 #define FAILURE 0
 #define SUCCESS 1
 
+/* I/O buffer of do_crypt, do_crypt_key and do_crypt_fd: default and largest
+ * size (see aes_crypt_set_bufsize) and the alignment it is allocated with */
+#define AES_CRYPT_BUFSIZE (256 * 1024)
+#define AES_CRYPT_BUFSIZE_MAX (64 * 1024 * 1024)
+#define AES_CRYPT_ALIGN 64
+
+/* Cipher modes for do_crypt_chunk. CBC matches do_crypt; CTR turns AES into a
+ * stream cipher whose blocks are independent, so encryption pipelines across
+ * AES-NI units the way CBC decryption already does. */
+#define AES_CRYPT_CBC 0
+#define AES_CRYPT_CTR 1
+#define AES_CRYPT_NMODES 2
+
+/* Sizes of the AES-256 key and IV produced by derive_key */
+#define AES_CRYPT_KEYLEN 32
+#define AES_CRYPT_IVLEN 16
+
+/* Key material derived once from a passphrase and reused for every call.
+ * Cipher contexts are kept per thread and stay keyed between calls. */
+struct aes_key {
+    unsigned char key[AES_CRYPT_KEYLEN];
+    unsigned char iv[AES_CRYPT_IVLEN];
+};
+
+/* Bytes run through the cipher by every call since the program started */
+struct aes_crypt_stats {
+    unsigned long long encrypted;
+    unsigned long long decrypted;
+};
+
 /* int do_crypt(FILE* in, FILE* out, int action, char* key_str)
  * Purpose: Perform cipher on in File* and place result in out File*
  * Args: FILE* in      : Input File Pointer
  *       FILE* out     : Output File Pointer
  *       int action    : Cipher action (1=encrypt, 0=decrypt, -1=pass-through (copy))
  *	 char* key_str : C-string containing passpharse from which key is derived
- * Return: FAILURE on error, SUCCESS on success
+ * Return: FAILURE on error, SUCCESS on success. The positions of in and out are
+ *         undefined afterwards.
  */
 extern int do_crypt(FILE* in, FILE* out, int action, char* key_str);
 
+/* int derive_key(const char* key_str, struct aes_key* key)
+ * Purpose: Derive the AES-256 key and IV used by do_crypt from a passphrase
+ * Args: const char* key_str  : C-string containing passphrase
+ *       struct aes_key* key  : Key object to fill
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int derive_key(const char* key_str, struct aes_key* key);
+
+/* int do_crypt_key(FILE* in, FILE* out, int action, const struct aes_key* key)
+ * Purpose: Same as do_crypt with a key already derived by derive_key. When both
+ *          streams are seekable files with no read-ahead buffered in in, out is
+ *          flushed and the descriptors are handed to do_crypt_fd; others (pipes,
+ *          fmemopen, cookie streams) go through fread/fwrite with the same
+ *          buffer size.
+ * Args: const struct aes_key* key : Key object (unused for pass-through)
+ * Return: FAILURE on error, SUCCESS on success. The positions of in and out are
+ *         undefined afterwards.
+ */
+extern int do_crypt_key(FILE* in, FILE* out, int action, const struct aes_key* key);
+
+/* void aes_crypt_set_bufsize(size_t size)
+ * Purpose: Set the I/O buffer size used by do_crypt, do_crypt_key and do_crypt_fd.
+ *          Call before starting any of them.
+ * Args: size_t size : Bytes per read/EVP_CipherUpdate/write, rounded up to
+ *                     AES_CRYPT_ALIGN and capped at AES_CRYPT_BUFSIZE_MAX;
+ *                     0 restores AES_CRYPT_BUFSIZE
+ */
+extern void aes_crypt_set_bufsize(size_t size);
+
+/* int do_crypt_fd(int infd, int outfd, int action, const struct aes_key* key)
+ * Purpose: Same as do_crypt_key between two file descriptors. Data moves through
+ *          large aligned buffers with read/write, no stdio involved, so each
+ *          EVP_CipherUpdate call covers a whole buffer (aes_crypt_set_bufsize).
+ * Args: int infd  : Input descriptor, read to end of file
+ *       int outfd : Output descriptor, written at its current offset
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int do_crypt_fd(int infd, int outfd, int action, const struct aes_key* key);
+
+/* int do_crypt_buf(const unsigned char* in, size_t inlen, unsigned char* out,
+ *                  size_t* outlen, int action, const struct aes_key* key)
+ * Purpose: Perform the do_crypt cipher between two memory buffers, no stdio involved
+ * Args: const unsigned char* in   : Input buffer
+ *       size_t inlen              : Input length
+ *       unsigned char* out        : Output buffer, at least inlen + AES_BLOCK_SIZE bytes
+ *       size_t* outlen            : Set to the number of bytes written to out
+ *       int action                : Cipher action (1=encrypt, 0=decrypt, -1=pass-through (copy))
+ *       const struct aes_key* key : Key object from derive_key
+ * Return: FAILURE on error (including bad padding on decrypt), SUCCESS on success
+ */
+extern int do_crypt_buf(const unsigned char* in, size_t inlen, unsigned char* out,
+			size_t* outlen, int action, const struct aes_key* key);
+
+/* ssize_t do_decrypt_fd(int fd, off_t offset, unsigned char* out, size_t len,
+ *                       const struct aes_key* key)
+ * Purpose: Decrypt a range of a file written by do_crypt straight from its descriptor.
+ *          CBC lets any block be decrypted from the one before it, so only the
+ *          range itself (plus one block) is read. Padding is not removed.
+ * Args: int fd                    : Descriptor of the encrypted file
+ *       off_t offset              : Ciphertext offset, multiple of AES_BLOCK_SIZE
+ *       unsigned char* out        : Output buffer of len bytes
+ *       size_t len                : Bytes to decrypt, multiple of AES_BLOCK_SIZE
+ *       const struct aes_key* key : Key object from derive_key
+ * Return: Number of bytes decrypted (short at end of file), -errno on error
+ */
+extern ssize_t do_decrypt_fd(int fd, off_t offset, unsigned char* out, size_t len,
+			     const struct aes_key* key);
+
+/* off_t do_crypt_plain_size(int fd, const struct aes_key* key)
+ * Purpose: Plaintext size of a file written by do_crypt, found by decrypting
+ *          only its last block to read the padding
+ * Return: Plaintext size, -errno on error (-EINVAL if the file is not valid ciphertext)
+ */
+extern off_t do_crypt_plain_size(int fd, const struct aes_key* key);
+
+/* int do_crypt_chunk(const unsigned char* in, int inlen, unsigned char* out,
+ *                    int action, int mode, const struct aes_key* key, const unsigned char* iv)
+ * Purpose: Perform AES-256 without padding on a single in-memory chunk
+ *          using the calling thread's cached cipher context
+ * Args: const unsigned char* in   : Input buffer
+ *       int inlen                 : Input length, must be a multiple of AES_BLOCK_SIZE
+ *       unsigned char* out        : Output buffer of at least inlen bytes (may equal in)
+ *       int action                : Cipher action (1=encrypt, 0=decrypt)
+ *       int mode                  : AES_CRYPT_CBC or AES_CRYPT_CTR
+ *       const struct aes_key* key : Key object from derive_key
+ *       const unsigned char* iv   : AES_CRYPT_IVLEN byte IV (CTR: initial counter) for this chunk
+ * Return: FAILURE on error, SUCCESS on success
+ */
+extern int do_crypt_chunk(const unsigned char* in, int inlen, unsigned char* out,
+			  int action, int mode, const struct aes_key* key, const unsigned char* iv);
+
+/* One independent piece of work for do_crypt_chunks */
+struct aes_chunk {
+    const unsigned char* in;
+    unsigned char* out;         /* may equal in */
+    int len;                    /* multiple of AES_BLOCK_SIZE */
+    const unsigned char* iv;
+};
+
+/* int do_crypt_chunks(const struct aes_chunk* chunks, int n, int action, int mode,
+ *                     const struct aes_key* key)
+ * Purpose: Run do_crypt_chunk on every chunk of a batch. Batches of at least the
+ *          worker threshold are spread over the worker pool, the calling thread
+ *          taking its share; smaller batches run on the calling thread only.
+ * Args: const struct aes_chunk* chunks : Chunks, processed in no particular order
+ *       int n                          : Number of chunks
+ *       int action, mode, key, iv      : As for do_crypt_chunk
+ * Return: FAILURE if any chunk failed, SUCCESS otherwise
+ */
+extern int do_crypt_chunks(const struct aes_chunk* chunks, int n, int action, int mode,
+			   const struct aes_key* key);
+
+/* void aes_crypt_set_workers(int threads, size_t threshold)
+ * Purpose: Configure the worker pool used by do_crypt_chunks and do_decrypt_fd.
+ *          Must be called before the first crypto call. The threads are started
+ *          on first use, so a process may fork (daemonize) after configuring.
+ * Args: int threads      : Threads working on a batch including the caller,
+ *                          0 for one per online CPU, 1 to disable the pool
+ *       size_t threshold : Smallest batch in bytes worth spreading over the pool
+ */
+extern void aes_crypt_set_workers(int threads, size_t threshold);
+
+/* void aes_crypt_get_stats(struct aes_crypt_stats* st)
+ * Purpose: Snapshot the byte counters. Pass-through (copy) calls are not counted.
+ */
+extern void aes_crypt_get_stats(struct aes_crypt_stats* st);
+
 #endif
@@ -0,0 +1,121 @@
+/* attr-cache.c
+ * Cache of the pa4-encfs extended attributes of backing files
+ *
+ * A direct-mapped table: the inode number picks the slot. Slots are spread
+ * over a few locks so getattr calls from different FUSE threads rarely meet.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "attr-cache.h"
+
+#define AC_LOCKS 16
+
+struct ac_slot {
+    dev_t dev;
+    ino_t ino;
+    struct timespec ctime;
+    int used;
+    int encrypted;
+    off_t size;
+};
+
+struct attr_cache {
+    pthread_mutex_t locks[AC_LOCKS];
+    unsigned long gens[AC_LOCKS];   /* bumped by ac_forget, per lock */
+    size_t mask;
+    struct ac_slot* slots;
+};
+
+static size_t ac_index(const struct attr_cache* ac, dev_t dev, ino_t ino){
+    unsigned long long h = ((unsigned long long) ino ^ ((unsigned long long) dev << 32)) *
+	0x9e3779b97f4a7c15ULL;
+
+    return (h >> 32) & ac->mask;
+}
+
+extern struct attr_cache* ac_create(size_t slots){
+    struct attr_cache* ac;
+    size_t n = 16;
+    int i;
+
+    while(n < slots)
+	n <<= 1;
+
+    ac = calloc(1, sizeof(*ac));
+    if(!ac)
+	return NULL;
+    ac->slots = calloc(n, sizeof(*ac->slots));
+    if(!ac->slots){
+	free(ac);
+	return NULL;
+    }
+    ac->mask = n - 1;
+    for(i = 0; i < AC_LOCKS; i++)
+	pthread_mutex_init(&ac->locks[i], NULL);
+
+    return ac;
+}
+
+extern void ac_destroy(struct attr_cache* ac){
+    int i;
+
+    if(!ac)
+	return;
+    for(i = 0; i < AC_LOCKS; i++)
+	pthread_mutex_destroy(&ac->locks[i]);
+    free(ac->slots);
+    free(ac);
+}
+
+extern int ac_lookup(struct attr_cache* ac, const struct stat* st, int* encrypted, off_t* size,
+		     unsigned long* gen){
+    size_t i = ac_index(ac, st->st_dev, st->st_ino);
+    struct ac_slot* s = &ac->slots[i];
+    int hit = 0;
+
+    pthread_mutex_lock(&ac->locks[i % AC_LOCKS]);
+    if(s->used && s->ino == st->st_ino && s->dev == st->st_dev &&
+       s->ctime.tv_sec == st->st_ctim.tv_sec && s->ctime.tv_nsec == st->st_ctim.tv_nsec){
+	*encrypted = s->encrypted;
+	*size = s->size;
+	hit = 1;
+    }
+    else{
+	*gen = ac->gens[i % AC_LOCKS];
+    }
+    pthread_mutex_unlock(&ac->locks[i % AC_LOCKS]);
+
+    return hit;
+}
+
+extern void ac_store(struct attr_cache* ac, const struct stat* st, int encrypted, off_t size,
+		     unsigned long gen){
+    size_t i = ac_index(ac, st->st_dev, st->st_ino);
+    struct ac_slot* s = &ac->slots[i];
+
+    pthread_mutex_lock(&ac->locks[i % AC_LOCKS]);
+    if(ac->gens[i % AC_LOCKS] != gen){
+	pthread_mutex_unlock(&ac->locks[i % AC_LOCKS]);
+	return;
+    }
+    s->dev = st->st_dev;
+    s->ino = st->st_ino;
+    s->ctime = st->st_ctim;
+    s->encrypted = encrypted;
+    s->size = encrypted ? size : -1;
+    s->used = 1;
+    pthread_mutex_unlock(&ac->locks[i % AC_LOCKS]);
+}
+
+extern void ac_forget(struct attr_cache* ac, dev_t dev, ino_t ino){
+    size_t i = ac_index(ac, dev, ino);
+    struct ac_slot* s = &ac->slots[i];
+
+    pthread_mutex_lock(&ac->locks[i % AC_LOCKS]);
+    if(s->used && s->ino == ino && s->dev == dev)
+	s->used = 0;
+    ac->gens[i % AC_LOCKS]++;
+    pthread_mutex_unlock(&ac->locks[i % AC_LOCKS]);
+}
@@ -0,0 +1,63 @@
+/* attr-cache.h
+ * Cache of the pa4-encfs extended attributes of backing files
+ *
+ * getattr needs to know whether a file is encrypted and, if it is, its
+ * plaintext size. Both live in extended attributes, which cost a getxattr
+ * each. This cache keeps them per inode in a fixed number of slots, one
+ * inode per slot, newer entries replacing older ones.
+ *
+ * Every entry remembers the ctime of the inode when it was filled in.
+ * Setting or removing an xattr, writing or truncating the file, renaming it
+ * and reusing the inode number all change ctime, so changes made directly
+ * in the mirror directory are noticed on the next lstat. ctime is only as
+ * fine as the kernel clock tick, so changes made through pa4-encfs also
+ * drop the entry with ac_forget. A generation number taken at lookup keeps
+ * a getattr that raced with such a change from storing the old values.
+ */
+
+#ifndef ATTR_CACHE_H
+#define ATTR_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+struct attr_cache;
+
+/* struct attr_cache* ac_create(size_t slots)
+ * Purpose: Create an empty cache
+ * Args: size_t slots : Number of inodes that can be cached, rounded up to a power of two
+ * Return: New cache, NULL on allocation failure
+ */
+extern struct attr_cache* ac_create(size_t slots);
+
+/* void ac_destroy(struct attr_cache* ac)
+ * Purpose: Free the cache
+ */
+extern void ac_destroy(struct attr_cache* ac);
+
+/* int ac_lookup(struct attr_cache* ac, const struct stat* st, int* encrypted, off_t* size,
+ *               unsigned long* gen)
+ * Purpose: Look up the attributes of the inode st describes
+ * Args: const struct stat* st : Current lstat/fstat of the backing file
+ *       int* encrypted        : Set to the cached encrypted flag
+ *       off_t* size           : Set to the cached plaintext size, -1 if not encrypted
+ *       unsigned long* gen    : On a miss, set to the generation to pass to ac_store
+ * Return: 1 on a hit, 0 if the inode is not cached or changed since
+ */
+extern int ac_lookup(struct attr_cache* ac, const struct stat* st, int* encrypted, off_t* size,
+		     unsigned long* gen);
+
+/* void ac_store(struct attr_cache* ac, const struct stat* st, int encrypted, off_t size,
+ *               unsigned long gen)
+ * Purpose: Remember the attributes of the inode st describes, as of st's ctime.
+ *          Nothing is stored if the inode was forgotten since the lookup that returned gen.
+ */
+extern void ac_store(struct attr_cache* ac, const struct stat* st, int encrypted, off_t size,
+		     unsigned long gen);
+
+/* void ac_forget(struct attr_cache* ac, dev_t dev, ino_t ino)
+ * Purpose: Drop the entry of an inode
+ */
+extern void ac_forget(struct attr_cache* ac, dev_t dev, ino_t ino);
+
+#endif
@@ -0,0 +1,223 @@
+/* block-cache.c
+ * In-memory cache of decrypted chunks used by pa4-encfs
+ *
+ * A chained hash table finds entries, a doubly linked list keeps them in
+ * least recently used order. One mutex covers both.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block-cache.h"
+
+struct bc_entry {
+    dev_t dev;
+    uint64_t ino;
+    off_t idx;
+    struct bc_entry* hnext;     /* hash chain */
+    struct bc_entry* prev;      /* LRU list, most recent first */
+    struct bc_entry* next;
+    size_t len;
+    unsigned char data[];
+};
+
+struct block_cache {
+    pthread_mutex_t lock;
+    struct bc_entry** buckets;
+    size_t nbuckets;            /* power of two */
+    struct bc_entry* head;      /* most recently used */
+    struct bc_entry* tail;      /* next to evict */
+    struct bc_stats st;
+};
+
+static size_t bc_hash(const struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx){
+    uint64_t h = (ino ^ (uint64_t) dev << 40) * 0x9e3779b97f4a7c15ULL ^
+	(uint64_t) idx * 0xc2b2ae3d27d4eb4fULL;
+
+    return (h ^ (h >> 29)) & (bc->nbuckets - 1);
+}
+
+static struct bc_entry* bc_lookup(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx){
+    struct bc_entry* e;
+
+    for(e = bc->buckets[bc_hash(bc, dev, ino, idx)]; e; e = e->hnext){
+	if(e->dev == dev && e->ino == ino && e->idx == idx)
+	    return e;
+    }
+    return NULL;
+}
+
+static void bc_lru_unlink(struct block_cache* bc, struct bc_entry* e){
+    if(e->prev)
+	e->prev->next = e->next;
+    else
+	bc->head = e->next;
+    if(e->next)
+	e->next->prev = e->prev;
+    else
+	bc->tail = e->prev;
+}
+
+static void bc_lru_push(struct block_cache* bc, struct bc_entry* e){
+    e->prev = NULL;
+    e->next = bc->head;
+    if(bc->head)
+	bc->head->prev = e;
+    bc->head = e;
+    if(!bc->tail)
+	bc->tail = e;
+}
+
+/* Unlink an entry from the table and the list and free it */
+static void bc_remove(struct block_cache* bc, struct bc_entry* e){
+    struct bc_entry** pp = &bc->buckets[bc_hash(bc, e->dev, e->ino, e->idx)];
+
+    while(*pp != e)
+	pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    bc_lru_unlink(bc, e);
+    bc->st.entries--;
+    bc->st.bytes -= e->len;
+    free(e);
+}
+
+extern struct block_cache* bc_create(size_t capacity, size_t block_size){
+    struct block_cache* bc;
+    size_t want = block_size ? capacity / block_size : 0;
+
+    bc = calloc(1, sizeof(*bc));
+    if(!bc)
+	return NULL;
+
+    /* About one entry per bucket once the cache is full */
+    bc->nbuckets = 64;
+    while(bc->nbuckets < want)
+	bc->nbuckets <<= 1;
+
+    bc->buckets = calloc(bc->nbuckets, sizeof(*bc->buckets));
+    if(!bc->buckets || pthread_mutex_init(&bc->lock, NULL)){
+	free(bc->buckets);
+	free(bc);
+	return NULL;
+    }
+    bc->st.capacity = capacity;
+    return bc;
+}
+
+extern void bc_destroy(struct block_cache* bc){
+    struct bc_entry* e;
+    struct bc_entry* next;
+
+    if(!bc)
+	return;
+    for(e = bc->head; e; e = next){
+	next = e->next;
+	free(e);
+    }
+    pthread_mutex_destroy(&bc->lock);
+    free(bc->buckets);
+    free(bc);
+}
+
+extern int bc_get(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx,
+		  size_t off, unsigned char* out, size_t len){
+    struct bc_entry* e;
+    int hit = 0;
+
+    pthread_mutex_lock(&bc->lock);
+    e = bc_lookup(bc, dev, ino, idx);
+    if(e && off + len <= e->len){
+	memcpy(out, e->data + off, len);
+	if(bc->head != e){
+	    bc_lru_unlink(bc, e);
+	    bc_lru_push(bc, e);
+	}
+	hit = 1;
+	bc->st.hits++;
+    }
+    else{
+	bc->st.misses++;
+    }
+    pthread_mutex_unlock(&bc->lock);
+
+    return hit;
+}
+
+extern int bc_contains(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx){
+    int found;
+
+    pthread_mutex_lock(&bc->lock);
+    found = bc_lookup(bc, dev, ino, idx) != NULL;
+    pthread_mutex_unlock(&bc->lock);
+
+    return found;
+}
+
+extern void bc_put(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx,
+		   const unsigned char* data, size_t len){
+    struct bc_entry* e;
+    struct bc_entry* old;
+    size_t h;
+
+    if(len > bc->st.capacity)
+	return;
+
+    /* Allocate and fill outside the lock, chunks can be large */
+    e = malloc(sizeof(*e) + len);
+    if(!e)
+	return;
+    e->dev = dev;
+    e->ino = ino;
+    e->idx = idx;
+    e->len = len;
+    memcpy(e->data, data, len);
+
+    pthread_mutex_lock(&bc->lock);
+    old = bc_lookup(bc, dev, ino, idx);
+    if(old)
+	bc_remove(bc, old);
+    while(bc->tail && bc->st.bytes + len > bc->st.capacity){
+	bc_remove(bc, bc->tail);
+	bc->st.evictions++;
+    }
+
+    h = bc_hash(bc, dev, ino, idx);
+    e->hnext = bc->buckets[h];
+    bc->buckets[h] = e;
+    bc_lru_push(bc, e);
+    bc->st.entries++;
+    bc->st.bytes += len;
+    pthread_mutex_unlock(&bc->lock);
+}
+
+extern void bc_invalidate(struct block_cache* bc, dev_t dev, uint64_t ino, off_t first, off_t last){
+    struct bc_entry* e;
+    struct bc_entry* next;
+    off_t idx;
+
+    pthread_mutex_lock(&bc->lock);
+    if(last >= first && (size_t) (last - first) < bc->st.entries){
+	/* Short ranges are cheaper to look up one by one */
+	for(idx = first; idx <= last; idx++){
+	    e = bc_lookup(bc, dev, ino, idx);
+	    if(e)
+		bc_remove(bc, e);
+	}
+    }
+    else{
+	for(e = bc->head; e; e = next){
+	    next = e->next;
+	    if(e->dev == dev && e->ino == ino && e->idx >= first && (last < 0 || e->idx <= last))
+		bc_remove(bc, e);
+	}
+    }
+    pthread_mutex_unlock(&bc->lock);
+}
+
+extern void bc_get_stats(struct block_cache* bc, struct bc_stats* st){
+    pthread_mutex_lock(&bc->lock);
+    *st = bc->st;
+    pthread_mutex_unlock(&bc->lock);
+}
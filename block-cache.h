@@ -0,0 +1,78 @@
+/* block-cache.h
+ * In-memory cache of decrypted chunks used by pa4-encfs
+ *
+ * Entries hold the plaintext of one chunk of an encrypted file and are keyed
+ * by the device and inode of the backing file and the chunk index. The cache is bounded
+ * by a byte budget and evicts the least recently used chunk first. All calls
+ * are safe to make from several threads.
+ *
+ * The cache does not know about the file format: callers invalidate the
+ * chunks they change (write, truncate) and whole inodes that go away
+ * (unlink, rename over an existing file).
+ */
+
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct block_cache;
+
+struct bc_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t entries;
+    size_t bytes;        /* plaintext bytes held */
+    size_t capacity;     /* byte budget */
+};
+
+/* struct block_cache* bc_create(size_t capacity, size_t block_size)
+ * Purpose: Create an empty cache
+ * Args: size_t capacity   : Byte budget for cached plaintext
+ *       size_t block_size : Typical entry size, used to size the hash table
+ * Return: New cache, NULL on allocation failure
+ */
+extern struct block_cache* bc_create(size_t capacity, size_t block_size);
+
+/* void bc_destroy(struct block_cache* bc)
+ * Purpose: Free the cache and every entry in it
+ */
+extern void bc_destroy(struct block_cache* bc);
+
+/* int bc_get(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx,
+ *            size_t off, unsigned char* out, size_t len)
+ * Purpose: Copy bytes [off, off+len) of a cached chunk and mark it recently used
+ * Return: 1 on a hit, 0 if the chunk is not cached
+ */
+extern int bc_get(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx,
+		  size_t off, unsigned char* out, size_t len);
+
+/* int bc_contains(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx)
+ * Purpose: Check whether a chunk is cached without copying it, counting a hit or
+ *          miss, or changing its place in the LRU order (for readahead)
+ * Return: 1 if the chunk is cached, 0 otherwise
+ */
+extern int bc_contains(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx);
+
+/* void bc_put(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx,
+ *             const unsigned char* data, size_t len)
+ * Purpose: Insert or replace the plaintext of a chunk, evicting old entries to
+ *          stay within the budget
+ */
+extern void bc_put(struct block_cache* bc, dev_t dev, uint64_t ino, off_t idx,
+		   const unsigned char* data, size_t len);
+
+/* void bc_invalidate(struct block_cache* bc, dev_t dev, uint64_t ino, off_t first, off_t last)
+ * Purpose: Drop the cached chunks first..last of an inode
+ * Args: off_t last : Last chunk to drop, -1 for every chunk from first on
+ */
+extern void bc_invalidate(struct block_cache* bc, dev_t dev, uint64_t ino, off_t first, off_t last);
+
+/* void bc_get_stats(struct block_cache* bc, struct bc_stats* st)
+ * Purpose: Snapshot the hit/miss counters and current usage
+ */
+extern void bc_get_stats(struct block_cache* bc, struct bc_stats* st);
+
+#endif
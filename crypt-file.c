@@ -0,0 +1,530 @@
+/* crypt-file.c
+ * Chunked, randomly addressable encrypted file format used by pa4-encfs
+ *
+ * See crypt-file.h for the on-disk layout.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/rand.h>
+
+#include "crypt-file.h"
+
+/* First version in which an all-zero IV marks a hole */
+#define CF_HOLES_VERSION 2
+
+/* Round a plaintext length up to the AES block size */
+#define CF_PAD(len) (((len) + AES_BLOCK_SIZE - 1) & ~((size_t) AES_BLOCK_SIZE - 1))
+
+/* pread until size bytes or end of file, returns bytes read or -errno */
+static ssize_t cf_pread_full(int fd, void* buf, size_t size, off_t offset){
+    size_t done = 0;
+    ssize_t res;
+
+    while(done < size){
+	res = pread(fd, (char*) buf + done, size - done, offset + done);
+	if(res == -1){
+	    if(errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	if(res == 0)
+	    break;
+	done += res;
+    }
+    return done;
+}
+
+/* pwrite all size bytes, returns 0 or -errno */
+static int cf_pwrite_full(int fd, const void* buf, size_t size, off_t offset){
+    size_t done = 0;
+    ssize_t res;
+
+    while(done < size){
+	res = pwrite(fd, (const char*) buf + done, size - done, offset + done);
+	if(res == -1){
+	    if(errno == EINTR)
+		continue;
+	    return -errno;
+	}
+	done += res;
+    }
+    return 0;
+}
+
+static void cf_put32(unsigned char* p, uint32_t v){
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t cf_get32(const unsigned char* p){
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+	((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* do_crypt_chunk mode for the cipher byte of a header */
+static int cf_mode(const struct cf_header* hdr){
+    return hdr->cipher == CF_CIPHER_AES256_CTR ? AES_CRYPT_CTR : AES_CRYPT_CBC;
+}
+
+extern void cf_init_header(struct cf_header* hdr, size_t chunk_size, int cipher){
+    hdr->version = CF_VERSION;
+    hdr->cipher = cipher;
+    hdr->chunk_size = chunk_size;
+}
+
+extern int cf_cipher_by_name(const char* name){
+    if(strcmp(name, "cbc") == 0)
+	return CF_CIPHER_AES256_CBC;
+    if(strcmp(name, "ctr") == 0)
+	return CF_CIPHER_AES256_CTR;
+    return -1;
+}
+
+extern int cf_read_header(int fd, struct cf_header* hdr){
+    unsigned char raw[CF_HEADER_LEN];
+    ssize_t res;
+
+    res = cf_pread_full(fd, raw, sizeof(raw), 0);
+    if(res < 0)
+	return res;
+    if(res < CF_HEADER_LEN || memcmp(raw, CF_MAGIC, 4) != 0)
+	return 0;
+
+    hdr->version = raw[4];
+    hdr->cipher = raw[5];
+    hdr->chunk_size = cf_get32(raw + 8);
+
+    if(hdr->version < 1 || hdr->version > CF_VERSION ||
+       (hdr->cipher != CF_CIPHER_AES256_CBC && hdr->cipher != CF_CIPHER_AES256_CTR) ||
+       hdr->chunk_size == 0 || hdr->chunk_size > CF_MAX_CHUNK ||
+       hdr->chunk_size % AES_BLOCK_SIZE){
+	fprintf(stderr, "Unsupported encrypted file header (version %d, cipher %d, chunk %zu)\n",
+		hdr->version, hdr->cipher, hdr->chunk_size);
+	return -EINVAL;
+    }
+    return 1;
+}
+
+extern int cf_write_header(int fd, const struct cf_header* hdr){
+    unsigned char raw[CF_HEADER_LEN];
+
+    memset(raw, 0, sizeof(raw));
+    memcpy(raw, CF_MAGIC, 4);
+    raw[4] = hdr->version;
+    raw[5] = hdr->cipher;
+    cf_put32(raw + 8, hdr->chunk_size);
+
+    return cf_pwrite_full(fd, raw, sizeof(raw), 0);
+}
+
+/* A slot never written since the file grew over it: the backing file reads as
+ * zeros there, and written slots never get an all-zero IV */
+static int cf_is_hole(const unsigned char* iv){
+    int i;
+
+    for(i = 0; i < CF_IV_LEN; i++){
+	if(iv[i])
+	    return 0;
+    }
+    return 1;
+}
+
+/* Mark the file as possibly holding holes before making any, so versions that
+ * would decrypt them as data refuse it instead. Returns 0 or -errno. */
+static int cf_allow_holes(int fd, struct cf_header* hdr){
+    int res;
+
+    if(hdr->version >= CF_HOLES_VERSION)
+	return 0;
+    hdr->version = CF_HOLES_VERSION;
+    res = cf_write_header(fd, hdr);
+    if(res < 0)
+	hdr->version = 1;
+    return res;
+}
+
+extern off_t cf_slot_offset(const struct cf_header* hdr, off_t idx){
+    return CF_HEADER_LEN + idx * (off_t) (CF_IV_LEN + hdr->chunk_size);
+}
+
+extern off_t cf_plain_bound(const struct cf_header* hdr, off_t backing_size){
+    off_t slot = CF_IV_LEN + hdr->chunk_size;
+    off_t body;
+    off_t tail;
+
+    if(backing_size <= CF_HEADER_LEN)
+	return 0;
+
+    body = backing_size - CF_HEADER_LEN;
+    tail = body % slot;
+    if(tail > CF_IV_LEN)
+	tail -= CF_IV_LEN;
+    else
+	tail = 0;
+
+    return (body / slot) * (off_t) hdr->chunk_size + tail;
+}
+
+/* Decrypt the ciphertext of one slot that has already been read into memory.
+ * avail is the number of slot bytes present in the backing file.
+ */
+static ssize_t cf_open_slot(const struct cf_header* hdr, const struct aes_key* key,
+			    const unsigned char* slot, size_t avail, unsigned char* plain){
+    size_t ctlen;
+
+    if(avail <= CF_IV_LEN || cf_is_hole(slot)){
+	memset(plain, 0, hdr->chunk_size);
+	return 0;
+    }
+
+    ctlen = (avail - CF_IV_LEN) & ~((size_t) AES_BLOCK_SIZE - 1);
+    if(ctlen > hdr->chunk_size)
+	ctlen = hdr->chunk_size;
+
+    if(!do_crypt_chunk(slot + CF_IV_LEN, ctlen, plain, 0, cf_mode(hdr), key, slot))
+	return -EIO;
+
+    memset(plain + ctlen, 0, hdr->chunk_size - ctlen);
+    return ctlen;
+}
+
+extern ssize_t cf_read_chunk(int fd, const struct cf_header* hdr, const struct aes_key* key,
+			     off_t idx, unsigned char* plain){
+    size_t slotlen = CF_IV_LEN + hdr->chunk_size;
+    unsigned char* slot;
+    ssize_t res;
+
+    slot = malloc(slotlen);
+    if(!slot)
+	return -ENOMEM;
+
+    res = cf_pread_full(fd, slot, slotlen, cf_slot_offset(hdr, idx));
+    if(res >= 0)
+	res = cf_open_slot(hdr, key, slot, res, plain);
+
+    free(slot);
+    return res;
+}
+
+/* Put a fresh IV and len bytes of plaintext, zero padded, into slot, ready to be
+ * encrypted in place. Returns the slot length or -errno. */
+static ssize_t cf_fill_slot(const unsigned char* plain, size_t len, unsigned char* slot){
+    size_t ctlen = CF_PAD(len);
+
+    /* Fresh IV for every write so rewritten chunks never reuse one */
+    if(RAND_bytes(slot, CF_IV_LEN) != 1)
+	return -EIO;
+    if(cf_is_hole(slot))
+	slot[0] = 1;
+
+    if(plain != slot + CF_IV_LEN)
+	memcpy(slot + CF_IV_LEN, plain, len);
+    memset(slot + CF_IV_LEN + len, 0, ctlen - len);
+
+    return CF_IV_LEN + ctlen;
+}
+
+/* Encrypt len bytes of one chunk under a fresh IV into slot, returns the slot length or -errno */
+static ssize_t cf_seal_slot(const struct cf_header* hdr, const struct aes_key* key,
+			    const unsigned char* plain, size_t len, unsigned char* slot){
+    ssize_t slotlen = cf_fill_slot(plain, len, slot);
+
+    if(slotlen < 0)
+	return slotlen;
+    if(!do_crypt_chunk(slot + CF_IV_LEN, slotlen - CF_IV_LEN, slot + CF_IV_LEN, 1,
+		       cf_mode(hdr), key, slot))
+	return -EIO;
+
+    return slotlen;
+}
+
+extern int cf_write_chunk(int fd, const struct cf_header* hdr, const struct aes_key* key,
+			  off_t idx, const unsigned char* plain, size_t len){
+    unsigned char* slot;
+    ssize_t slotlen;
+    int res;
+
+    if(len > hdr->chunk_size)
+	return -EINVAL;
+
+    slot = malloc(CF_IV_LEN + CF_PAD(len));
+    if(!slot)
+	return -ENOMEM;
+
+    slotlen = cf_seal_slot(hdr, key, plain, len, slot);
+    if(slotlen < 0)
+	res = slotlen;
+    else
+	res = cf_pwrite_full(fd, slot, slotlen, cf_slot_offset(hdr, idx));
+
+    free(slot);
+    return res;
+}
+
+extern ssize_t cf_pread(int fd, const struct cf_header* hdr, const struct aes_key* key,
+			char* buf, size_t size, off_t offset, off_t plain_size){
+    size_t cs = hdr->chunk_size;
+    size_t slotlen = CF_IV_LEN + cs;
+    off_t first;
+    off_t last;
+    off_t i;
+    unsigned char* slots;
+    unsigned char* edge;
+    struct aes_chunk* jobs;
+    int njobs = 0;
+    size_t first_lo;
+    size_t first_hi;
+    size_t last_hi;
+    ssize_t got;
+    ssize_t res = 0;
+
+    if(offset >= plain_size || size == 0)
+	return 0;
+    if((off_t) size > plain_size - offset)
+	size = plain_size - offset;
+
+    first = offset / cs;
+    last = (offset + size - 1) / cs;
+    first_lo = offset - first * (off_t) cs;
+    first_hi = last == first ? first_lo + size : cs;
+    last_hi = offset + size - last * (off_t) cs;
+
+    /* The covering slots are contiguous, so fetch them with one pread */
+    slots = malloc((last - first + 1) * slotlen);
+    edge = malloc(2 * cs);
+    jobs = malloc((last - first + 1) * sizeof(*jobs));
+    if(!slots || !edge || !jobs){
+	res = -ENOMEM;
+	goto out;
+    }
+
+    got = cf_pread_full(fd, slots, (last - first + 1) * slotlen, cf_slot_offset(hdr, first));
+    if(got < 0){
+	res = got;
+	goto out;
+    }
+
+    /* Whole chunks are decrypted straight into the caller's buffer, the partial
+     * ones at either end into edge. All of them go to the worker pool at once. */
+    for(i = first; i <= last; i++){
+	size_t pos = (i - first) * slotlen;
+	size_t avail = 0;
+	size_t ctlen = 0;
+	unsigned char* dst;
+
+	if(i == first && (first_lo != 0 || first_hi != cs))
+	    dst = edge;
+	else if(i == last && i != first && last_hi != cs)
+	    dst = edge + cs;
+	else
+	    dst = (unsigned char*) buf + (i * (off_t) cs - offset);
+
+	if((size_t) got > pos)
+	    avail = (size_t) got - pos < slotlen ? (size_t) got - pos : slotlen;
+	if(avail > CF_IV_LEN && !cf_is_hole(slots + pos)){
+	    ctlen = (avail - CF_IV_LEN) & ~((size_t) AES_BLOCK_SIZE - 1);
+	    if(ctlen > cs)
+		ctlen = cs;
+	}
+	/* Anything the slot does not hold reads as zeros */
+	memset(dst + ctlen, 0, cs - ctlen);
+
+	if(ctlen){
+	    jobs[njobs].in = slots + pos + CF_IV_LEN;
+	    jobs[njobs].out = dst;
+	    jobs[njobs].len = ctlen;
+	    jobs[njobs].iv = slots + pos;
+	    njobs++;
+	}
+    }
+
+    if(!do_crypt_chunks(jobs, njobs, 0, cf_mode(hdr), key)){
+	res = -EIO;
+	goto out;
+    }
+
+    if(first_lo != 0 || first_hi != cs)
+	memcpy(buf, edge + first_lo, first_hi - first_lo);
+    if(last != first && last_hi != cs)
+	memcpy(buf + (last * (off_t) cs - offset), edge + cs, last_hi);
+    res = size;
+
+out:
+    free(slots);
+    free(edge);
+    free(jobs);
+    return res;
+}
+
+extern ssize_t cf_pwrite(int fd, struct cf_header* hdr, const struct aes_key* key,
+			 const char* buf, size_t size, off_t offset, off_t* plain_size){
+    size_t cs = hdr->chunk_size;
+    size_t slotlen = CF_IV_LEN + cs;
+    off_t old_size = *plain_size;
+    off_t end = offset + size;
+    off_t new_size = end > old_size ? end : old_size;
+    off_t first;
+    off_t last;
+    off_t idx;
+    unsigned char* slots;
+    unsigned char* plain;
+    struct aes_chunk* jobs;
+    int njobs = 0;
+    ssize_t res = 0;
+    size_t pos = 0;
+    size_t done = 0;
+
+    if(size == 0)
+	return 0;
+
+    first = offset / cs;
+    last = (end - 1) / cs;
+
+    plain = malloc(cs);
+    if(!plain)
+	return -ENOMEM;
+
+    /* Only the last slot may be short: before writing past it, pad the old
+     * last chunk to full length. A hole needs nothing, the write below extends
+     * it with zeros, and so are the chunks of any gap up to first. */
+    if(old_size > 0 && old_size % cs && (old_size - 1) / (off_t) cs < first){
+	idx = (old_size - 1) / cs;
+	res = cf_read_chunk(fd, hdr, key, idx, plain);
+	if(res > 0)
+	    res = cf_write_chunk(fd, hdr, key, idx, plain, cs);
+	else if(res == 0)
+	    res = cf_allow_holes(fd, hdr);
+    }
+    if(res >= 0 && (off_t) ((old_size + cs - 1) / cs) < first)
+	res = cf_allow_holes(fd, hdr);
+    if(res < 0){
+	free(plain);
+	return res;
+    }
+
+    /* Lay out every touched chunk in one contiguous buffer, encrypt them all on the
+     * worker pool, then write them with a single pwrite */
+    slots = malloc((last - first + 1) * slotlen);
+    jobs = malloc((last - first + 1) * sizeof(*jobs));
+    if(!slots || !jobs){
+	free(slots);
+	free(jobs);
+	free(plain);
+	return -ENOMEM;
+    }
+
+    for(idx = first; idx <= last; idx++){
+	off_t start = idx * (off_t) cs;
+	size_t lo = offset > start ? offset - start : 0;
+	size_t hi = end < start + (off_t) cs ? (size_t) (end - start) : cs;
+	size_t len = new_size - start < (off_t) cs ? (size_t) (new_size - start) : cs;
+	const unsigned char* src;
+
+	if(lo == 0 && hi == len){
+	    /* Chunk fully overwritten, copied straight from the caller's buffer */
+	    src = (const unsigned char*) buf + done;
+	}
+	else{
+	    /* Partial chunk: merge the new bytes into the existing plaintext */
+	    if(start < old_size){
+		res = cf_read_chunk(fd, hdr, key, idx, plain);
+		if(res < 0)
+		    break;
+	    }
+	    else{
+		memset(plain, 0, cs);
+	    }
+	    memcpy(plain + lo, buf + done, hi - lo);
+	    src = plain;
+	}
+
+	res = cf_fill_slot(src, len, slots + pos);
+	if(res < 0)
+	    break;
+	jobs[njobs].in = slots + pos + CF_IV_LEN;
+	jobs[njobs].out = slots + pos + CF_IV_LEN;
+	jobs[njobs].len = res - CF_IV_LEN;
+	jobs[njobs].iv = slots + pos;
+	njobs++;
+	pos += res;
+	done += hi - lo;
+    }
+
+    if(res >= 0 && !do_crypt_chunks(jobs, njobs, 1, cf_mode(hdr), key))
+	res = -EIO;
+    if(res >= 0)
+	res = cf_pwrite_full(fd, slots, pos, cf_slot_offset(hdr, first));
+    if(res >= 0){
+	*plain_size = new_size;
+	res = size;
+    }
+
+    free(slots);
+    free(jobs);
+    free(plain);
+    return res;
+}
+
+extern int cf_truncate(int fd, struct cf_header* hdr, const struct aes_key* key,
+		       off_t* plain_size, off_t new_size){
+    size_t cs = hdr->chunk_size;
+    size_t tail = new_size % cs;
+    off_t idx;
+    off_t end;
+    unsigned char* plain;
+    ssize_t res = 0;
+    int holes;
+
+    if(new_size == *plain_size)
+	return 0;
+
+    plain = malloc(cs);
+    if(!plain)
+	return -ENOMEM;
+
+    if(new_size > *plain_size){
+	/* Growing rewrites the old partial last chunk at its new length (unless it
+	 * is a hole) and extends the backing file: the chunks after it are holes */
+	idx = *plain_size / cs;
+	holes = 1;
+	if(*plain_size % cs){
+	    res = cf_read_chunk(fd, hdr, key, idx, plain);
+	    if(res > 0){
+		size_t len = new_size - idx * (off_t) cs < (off_t) cs ?
+		    (size_t) (new_size - idx * (off_t) cs) : cs;
+		res = cf_write_chunk(fd, hdr, key, idx, plain, len);
+		holes = (new_size - 1) / (off_t) cs > idx;
+	    }
+	}
+	if(res >= 0 && holes)
+	    res = cf_allow_holes(fd, hdr);
+    }
+    else if(tail){
+	/* Shrinking only rewrites the chunk holding the new end, then cuts the slots
+	 * after it. A hole stays one. */
+	res = cf_read_chunk(fd, hdr, key, new_size / cs, plain);
+	if(res > 0)
+	    res = cf_write_chunk(fd, hdr, key, new_size / cs, plain, tail);
+    }
+    free(plain);
+    if(res < 0)
+	return res;
+
+    end = cf_slot_offset(hdr, new_size / cs);
+    if(tail)
+	end += CF_IV_LEN + CF_PAD(tail);
+    if(ftruncate(fd, end) == -1)
+	return -errno;
+
+    *plain_size = new_size;
+    return 0;
+}
@@ -0,0 +1,151 @@
+/* crypt-file.h
+ * Chunked, randomly addressable encrypted file format used by pa4-encfs
+ *
+ * An encrypted file is a fixed-size header followed by a sequence of slots.
+ * Slot i holds plaintext bytes [i*chunk_size, (i+1)*chunk_size) encrypted
+ * independently with AES-256 (CBC or CTR, see the header) under its own random IV:
+ *
+ *   | header | IV 0 | chunk 0 | IV 1 | chunk 1 | ... | IV n | last chunk |
+ *
+ * Every slot except the last one is full length, so the slot holding any
+ * plaintext offset is found with arithmetic alone and a read of
+ * offset,size only touches the covering slots. Chunks are zero padded to
+ * the AES block size; the exact plaintext length is kept by the caller
+ * (pa4-encfs stores it in an extended attribute).
+ *
+ * Since version 2 a slot whose IV is all zeros is a hole and reads as zeros.
+ * Growing a file (truncate, or a write past the end) leaves the new chunks
+ * as holes by extending the backing file, which the filesystem stores
+ * sparsely, so growing costs the same however far the file grows. Written
+ * slots never get an all-zero IV. Version 1 files are read the same way and
+ * are upgraded to version 2 when holes are first made in them.
+ *
+ * Files without the header are treated as the original whole-file CBC
+ * format written by do_crypt.
+ */
+
+#ifndef CRYPT_FILE_H
+#define CRYPT_FILE_H
+
+#include <sys/types.h>
+
+#include "aes-crypt.h"
+
+#define CF_MAGIC "PA4E"
+#define CF_VERSION 2
+
+/* Cipher byte of the header. The format is otherwise the same for every cipher:
+ * chunks are zero padded to the AES block size either way, so slot offsets do
+ * not depend on it. */
+#define CF_CIPHER_AES256_CBC 1
+#define CF_CIPHER_AES256_CTR 2
+
+#define CF_HEADER_LEN 16
+#define CF_IV_LEN AES_CRYPT_IVLEN
+#define CF_DEFAULT_CHUNK 4096
+#define CF_MAX_CHUNK (1 << 20)
+
+struct cf_header {
+    int version;
+    int cipher;
+    size_t chunk_size;
+};
+
+/* void cf_init_header(struct cf_header* hdr, size_t chunk_size, int cipher)
+ * Purpose: Fill in a header for a new file in the current format
+ * Args: struct cf_header* hdr : Header to fill
+ *       size_t chunk_size     : Plaintext bytes per chunk, multiple of AES_BLOCK_SIZE
+ *       int cipher            : CF_CIPHER_AES256_CBC or CF_CIPHER_AES256_CTR
+ */
+extern void cf_init_header(struct cf_header* hdr, size_t chunk_size, int cipher);
+
+/* int cf_cipher_by_name(const char* name)
+ * Purpose: Map a cipher name ("cbc" or "ctr") to its header byte
+ * Return: CF_CIPHER_* value, -1 for an unknown name
+ */
+extern int cf_cipher_by_name(const char* name);
+
+/* int cf_read_header(int fd, struct cf_header* hdr)
+ * Purpose: Read and validate the header of an encrypted file. Files with a newer
+ *          version or an unknown cipher are refused rather than misread.
+ * Args: int fd               : Backing file descriptor
+ *       struct cf_header* hdr : Filled in when the file is chunked
+ * Return: 1 if the file is chunked, 0 if it is in the legacy whole-file format,
+ *         -errno on error
+ */
+extern int cf_read_header(int fd, struct cf_header* hdr);
+
+/* int cf_write_header(int fd, const struct cf_header* hdr)
+ * Purpose: Write the header at the start of the backing file
+ * Return: 0 on success, -errno on error
+ */
+extern int cf_write_header(int fd, const struct cf_header* hdr);
+
+/* off_t cf_slot_offset(const struct cf_header* hdr, off_t idx)
+ * Purpose: Byte offset of the slot holding chunk idx in the backing file
+ */
+extern off_t cf_slot_offset(const struct cf_header* hdr, off_t idx);
+
+/* off_t cf_plain_bound(const struct cf_header* hdr, off_t backing_size)
+ * Purpose: Upper bound of the plaintext size of a backing file of the given size.
+ *          Exact up to the zero padding of the last chunk; only used to recover
+ *          files whose recorded size was lost.
+ */
+extern off_t cf_plain_bound(const struct cf_header* hdr, off_t backing_size);
+
+/* ssize_t cf_read_chunk(int fd, const struct cf_header* hdr, const struct aes_key* key,
+ *                       off_t idx, unsigned char* plain)
+ * Purpose: Read and decrypt a single chunk
+ * Args: unsigned char* plain : Output buffer of hdr->chunk_size bytes; bytes past the
+ *                              stored chunk are zeroed
+ * Return: Number of plaintext bytes stored for the chunk (0 past end of file or for
+ *         a hole), -errno on error
+ */
+extern ssize_t cf_read_chunk(int fd, const struct cf_header* hdr, const struct aes_key* key,
+			     off_t idx, unsigned char* plain);
+
+/* int cf_write_chunk(int fd, const struct cf_header* hdr, const struct aes_key* key,
+ *                    off_t idx, const unsigned char* plain, size_t len)
+ * Purpose: Encrypt len bytes of chunk idx under a fresh IV and write its slot
+ * Return: 0 on success, -errno on error
+ */
+extern int cf_write_chunk(int fd, const struct cf_header* hdr, const struct aes_key* key,
+			  off_t idx, const unsigned char* plain, size_t len);
+
+/* ssize_t cf_pread(int fd, const struct cf_header* hdr, const struct aes_key* key,
+ *                  char* buf, size_t size, off_t offset, off_t plain_size)
+ * Purpose: Decrypt plaintext bytes [offset, offset+size) into buf, reading only the
+ *          slots that cover the range
+ * Args: off_t plain_size : Plaintext size of the file; reads are clipped to it
+ * Return: Number of bytes read, -errno on error
+ */
+extern ssize_t cf_pread(int fd, const struct cf_header* hdr, const struct aes_key* key,
+			char* buf, size_t size, off_t offset, off_t plain_size);
+
+/* ssize_t cf_pwrite(int fd, struct cf_header* hdr, const struct aes_key* key,
+ *                   const char* buf, size_t size, off_t offset, off_t* plain_size)
+ * Purpose: Write plaintext bytes [offset, offset+size), re-encrypting only the chunks the
+ *          range touches. Partial chunks at either end are read, merged and rewritten,
+ *          fully covered chunks are encrypted straight from buf. Writing past the end pads
+ *          the old last chunk to full length and leaves any gap as holes.
+ * Args: struct cf_header* hdr : Header of the file, its version is raised when holes are made
+ *       off_t* plain_size     : Current plaintext size on entry, new size on return
+ * Return: Number of bytes written, -errno on error
+ */
+extern ssize_t cf_pwrite(int fd, struct cf_header* hdr, const struct aes_key* key,
+			 const char* buf, size_t size, off_t offset, off_t* plain_size);
+
+/* int cf_truncate(int fd, struct cf_header* hdr, const struct aes_key* key,
+ *                 off_t* plain_size, off_t new_size)
+ * Purpose: Change the plaintext size of a chunked file touching at most one chunk.
+ *          Shrinking rewrites the chunk holding the new end and cuts the backing file
+ *          after it; growing rewrites the old partial last chunk to its new length and
+ *          extends the backing file, leaving the chunks after it as holes.
+ * Args: struct cf_header* hdr : Header of the file, its version is raised when holes are made
+ *       off_t* plain_size     : Current plaintext size on entry, new size on return
+ * Return: 0 on success, -errno on error
+ */
+extern int cf_truncate(int fd, struct cf_header* hdr, const struct aes_key* key,
+		       off_t* plain_size, off_t new_size);
+
+#endif
@@ -0,0 +1,670 @@
+/* encfs-bench.c
+ * Filesystem benchmark for pa4-encfs, run by 'make bench'
+ *
+ * Creates a scratch directory, runs each workload on a plain directory in it
+ * (the raw baseline), then mounts pa4-encfs over a mirror directory next to it
+ * and runs the same workloads through the mount twice: once on files created
+ * through the mount (encrypted) and once on files created directly in the
+ * mirror (unencrypted). Every workload prints its throughput, the p50 and p99
+ * latency of its operations and how much slower than raw it ran.
+ *
+ * Workloads use a fixed random seed and fixed sizes (times -s), so runs of two
+ * builds on the same machine can be compared line by line.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define USAGE "[-s <scale>] [-o <mount options>] [-k] [-t <scratch dir>] <pa4-encfs path>"
+
+#define BENCH_KEY "encfs-bench"
+
+/* Sizes of the workloads at scale 1 */
+#define BENCH_STAT_FILES 1000
+#define BENCH_STAT_PASSES 10
+#define BENCH_BIG_MB 64
+#define BENCH_SEQ_BLOCK (128 * 1024)
+#define BENCH_RAND_READS 5000
+#define BENCH_RAND_BLOCK 4096
+#define BENCH_APPENDS 20000
+#define BENCH_APPEND_SIZE 100
+#define BENCH_COPY_BLOCK (1024 * 1024)
+#define BENCH_CHURN_FILES 2000
+#define BENCH_CHURN_SIZE 4096
+#define BENCH_DIR_FILES 5000
+#define BENCH_DIR_PASSES 10
+
+/* Seconds to wait for the mount to appear */
+#define BENCH_MOUNT_WAIT 10
+
+/* Latencies of one workload's operations, in seconds */
+struct bench_lat {
+    double* v;
+    size_t n;
+    size_t cap;
+};
+
+/* One workload run on one target */
+struct bench_result {
+    size_t ops;
+    double secs;        /* time spent in the timed operations, not in setup */
+    double bytes;       /* data moved, 0 for metadata workloads */
+    double p50;
+    double p99;
+    int failed;
+};
+
+/* Where a workload runs: files it reads are created in setup, everything is
+ * then done in dir. For the raw baseline and the encrypted run both are the
+ * same directory; for the unencrypted run setup is the mirror behind dir.
+ */
+struct bench_target {
+    const char* name;
+    char dir[PATH_MAX / 2];     /* leaves room for the workloads' file names */
+    char setup[PATH_MAX / 2];
+    int skip_create;    /* files created in dir would not be like the rest */
+};
+
+struct bench_workload {
+    const char* name;
+    int (*run)(const struct bench_target* t, struct bench_lat* lat, double* bytes);
+    int creates;        /* creates its files through dir */
+};
+
+static int scale = 1;
+static char* data;      /* BENCH_COPY_BLOCK of random bytes to write */
+
+static double now_sec(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int lat_add(struct bench_lat* lat, double secs){
+    double* v;
+
+    if(lat->n == lat->cap){
+	lat->cap = lat->cap ? lat->cap * 2 : 1024;
+	v = realloc(lat->v, lat->cap * sizeof(*v));
+	if(!v)
+	    return -1;
+	lat->v = v;
+    }
+    lat->v[lat->n++] = secs;
+    return 0;
+}
+
+static int cmp_double(const void* a, const void* b){
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+static double lat_pct(const struct bench_lat* lat, double pct){
+    size_t i;
+
+    if(lat->n == 0)
+	return 0;
+    i = (size_t) (pct / 100.0 * (lat->n - 1) + 0.5);
+    return lat->v[i];
+}
+
+/* Time one call of an expression that is 0 on success, adding it to lat */
+#define TIMED(lat, expr)					\
+    do {							\
+	double t0_ = now_sec();					\
+	if((expr) != 0){					\
+	    perror(#expr);					\
+	    return -1;						\
+	}							\
+	if(lat_add((lat), now_sec() - t0_))			\
+	    return -1;						\
+    } while(0)
+
+static int write_all(int fd, const char* buf, size_t len){
+    ssize_t n;
+
+    while(len > 0){
+	n = write(fd, buf, len);
+	if(n < 0)
+	    return -1;
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* pread that is 0 on success; a short read at end of file is fine */
+static int read_at(int fd, char* buf, size_t len, off_t off){
+    return pread(fd, buf, len, off) < 0 ? -1 : 0;
+}
+
+/* Create path with size bytes of data */
+static int make_file(const char* path, off_t size){
+    int fd;
+    off_t done;
+    size_t len;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1){
+	perror(path);
+	return -1;
+    }
+    for(done = 0; done < size; done += len){
+	len = size - done < BENCH_COPY_BLOCK ? size - done : BENCH_COPY_BLOCK;
+	if(write_all(fd, data, len)){
+	    perror(path);
+	    close(fd);
+	    return -1;
+	}
+    }
+    return close(fd);
+}
+
+static int make_dir(const char* path){
+    if(mkdir(path, 0755) && errno != EEXIST){
+	perror(path);
+	return -1;
+    }
+    return 0;
+}
+
+/* Drop what the kernel cached of a file so reads reach the filesystem */
+static void drop_cache(int fd){
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+/* lstat every file of a directory BENCH_STAT_PASSES times */
+static int wl_stat(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    char path[PATH_MAX];
+    struct stat st;
+    int n = BENCH_STAT_FILES * scale;
+    int i;
+    int pass;
+
+    (void) bytes;
+    snprintf(path, sizeof(path), "%s/stat", t->setup);
+    if(make_dir(path))
+	return -1;
+    for(i = 0; i < n; i++){
+	snprintf(path, sizeof(path), "%s/stat/f%d", t->setup, i);
+	if(make_file(path, 1000))
+	    return -1;
+    }
+
+    for(pass = 0; pass < BENCH_STAT_PASSES; pass++){
+	for(i = 0; i < n; i++){
+	    snprintf(path, sizeof(path), "%s/stat/f%d", t->dir, i);
+	    TIMED(lat, lstat(path, &st));
+	}
+    }
+    return 0;
+}
+
+static int big_file(const struct bench_target* t, char* path, size_t len){
+    struct stat st;
+
+    snprintf(path, len, "%s/big", t->setup);
+    if(stat(path, &st) == 0 && st.st_size == (off_t) BENCH_BIG_MB * scale << 20)
+	return 0;
+    return make_file(path, (off_t) BENCH_BIG_MB * scale << 20);
+}
+
+/* Read a large file front to back */
+static int wl_seqread(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    char path[PATH_MAX];
+    char* buf;
+    off_t size = (off_t) BENCH_BIG_MB * scale << 20;
+    off_t off;
+    int fd;
+
+    if(big_file(t, path, sizeof(path)))
+	return -1;
+    snprintf(path, sizeof(path), "%s/big", t->dir);
+    fd = open(path, O_RDONLY);
+    if(fd == -1){
+	perror(path);
+	return -1;
+    }
+    drop_cache(fd);
+    buf = malloc(BENCH_SEQ_BLOCK);
+    if(!buf){
+	close(fd);
+	return -1;
+    }
+
+    for(off = 0; off < size; off += BENCH_SEQ_BLOCK)
+	TIMED(lat, read_at(fd, buf, BENCH_SEQ_BLOCK, off));
+    *bytes = size;
+
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+/* 4 KiB reads at random offsets of a large file */
+static int wl_randread(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    char path[PATH_MAX];
+    char buf[BENCH_RAND_BLOCK];
+    off_t blocks = ((off_t) BENCH_BIG_MB * scale << 20) / BENCH_RAND_BLOCK;
+    int n = BENCH_RAND_READS * scale;
+    int fd;
+    int i;
+
+    if(big_file(t, path, sizeof(path)))
+	return -1;
+    snprintf(path, sizeof(path), "%s/big", t->dir);
+    fd = open(path, O_RDONLY);
+    if(fd == -1){
+	perror(path);
+	return -1;
+    }
+    drop_cache(fd);
+
+    srand(1);
+    for(i = 0; i < n; i++)
+	TIMED(lat, read_at(fd, buf, sizeof(buf), (rand() % blocks) * BENCH_RAND_BLOCK));
+    *bytes = (double) n * BENCH_RAND_BLOCK;
+
+    close(fd);
+    return 0;
+}
+
+/* Many small appends to one file, like a log; close is timed as the last op */
+static int wl_append(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    char path[PATH_MAX];
+    int n = BENCH_APPENDS * scale;
+    int fd;
+    int i;
+
+    snprintf(path, sizeof(path), "%s/log", t->setup);
+    if(make_file(path, 0))
+	return -1;
+    snprintf(path, sizeof(path), "%s/log", t->dir);
+    fd = open(path, O_WRONLY | O_APPEND);
+    if(fd == -1){
+	perror(path);
+	return -1;
+    }
+
+    for(i = 0; i < n; i++)
+	TIMED(lat, write_all(fd, data, BENCH_APPEND_SIZE));
+    TIMED(lat, close(fd));
+    *bytes = (double) n * BENCH_APPEND_SIZE;
+    return 0;
+}
+
+/* Write a large file in 1 MiB blocks and fsync it, as cp would */
+static int wl_copy(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    char path[PATH_MAX];
+    off_t size = (off_t) BENCH_BIG_MB * scale << 20;
+    off_t off;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/copy", t->setup);
+    if(make_file(path, 0))
+	return -1;
+    snprintf(path, sizeof(path), "%s/copy", t->dir);
+    fd = open(path, O_WRONLY | O_TRUNC);
+    if(fd == -1){
+	perror(path);
+	return -1;
+    }
+
+    for(off = 0; off < size; off += BENCH_COPY_BLOCK)
+	TIMED(lat, write_all(fd, data, BENCH_COPY_BLOCK));
+    TIMED(lat, fsync(fd));
+    TIMED(lat, close(fd));
+    *bytes = size;
+    return 0;
+}
+
+/* Create, write, close and unlink small files; one op is the whole cycle */
+static int wl_churn(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    char path[PATH_MAX];
+    int n = BENCH_CHURN_FILES * scale;
+    double t0;
+    int fd;
+    int i;
+
+    snprintf(path, sizeof(path), "%s/churn", t->dir);
+    if(make_dir(path))
+	return -1;
+
+    for(i = 0; i < n; i++){
+	snprintf(path, sizeof(path), "%s/churn/f%d", t->dir, i);
+	t0 = now_sec();
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if(fd == -1 || write_all(fd, data, BENCH_CHURN_SIZE) || close(fd) || unlink(path)){
+	    perror(path);
+	    return -1;
+	}
+	if(lat_add(lat, now_sec() - t0))
+	    return -1;
+    }
+    *bytes = (double) n * BENCH_CHURN_SIZE;
+    return 0;
+}
+
+/* List a large directory BENCH_DIR_PASSES times, lstat'ing every entry as ls -l
+ * does if stat_each is set, names only as ls and find -name do otherwise; one op
+ * is a pass */
+static int list_dir(const struct bench_target* t, struct bench_lat* lat, int stat_each){
+    char path[PATH_MAX];
+    struct dirent* de;
+    struct stat st;
+    DIR* dp;
+    int n = BENCH_DIR_FILES * scale;
+    int seen;
+    int pass;
+    int i;
+    double t0;
+
+    snprintf(path, sizeof(path), "%s/dir", t->setup);
+    if(make_dir(path))
+	return -1;
+    for(i = 0; i < n; i++){
+	snprintf(path, sizeof(path), "%s/dir/file-with-a-longer-name-%d", t->setup, i);
+	if(stat(path, &st) == 0)
+	    continue;
+	if(make_file(path, 100))
+	    return -1;
+    }
+
+    for(pass = 0; pass < BENCH_DIR_PASSES; pass++){
+	snprintf(path, sizeof(path), "%s/dir", t->dir);
+	t0 = now_sec();
+	dp = opendir(path);
+	if(!dp){
+	    perror(path);
+	    return -1;
+	}
+	seen = 0;
+	while((de = readdir(dp)) != NULL){
+	    if(!stat_each || fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		seen++;
+	}
+	closedir(dp);
+	if(seen < n){
+	    fprintf(stderr, "%s: saw %d of %d entries\n", path, seen, n);
+	    return -1;
+	}
+	if(lat_add(lat, now_sec() - t0))
+	    return -1;
+    }
+    return 0;
+}
+
+static int wl_list(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    (void) bytes;
+    return list_dir(t, lat, 0);
+}
+
+static int wl_readdir(const struct bench_target* t, struct bench_lat* lat, double* bytes){
+    (void) bytes;
+    return list_dir(t, lat, 1);
+}
+
+static const struct bench_workload workloads[] = {
+    { "stat", wl_stat, 0 },
+    { "seqread", wl_seqread, 0 },
+    { "randread", wl_randread, 0 },
+    { "append", wl_append, 0 },
+    { "copy", wl_copy, 0 },
+    { "churn", wl_churn, 1 },
+    { "list", wl_list, 0 },
+    { "readdir", wl_readdir, 0 },
+};
+
+#define NWORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static void run_target(const struct bench_target* t, struct bench_result* res){
+    struct bench_lat lat = { NULL, 0, 0 };
+    size_t i;
+    size_t k;
+
+    for(i = 0; i < NWORKLOADS; i++){
+	memset(&res[i], 0, sizeof(res[i]));
+	if(workloads[i].creates && t->skip_create){
+	    res[i].failed = -1;
+	    continue;
+	}
+	lat.n = 0;
+	if(workloads[i].run(t, &lat, &res[i].bytes) || lat.n == 0){
+	    fprintf(stderr, "%s on %s failed\n", workloads[i].name, t->name);
+	    res[i].failed = 1;
+	    continue;
+	}
+	res[i].ops = lat.n;
+	for(k = 0; k < lat.n; k++)
+	    res[i].secs += lat.v[k];
+	qsort(lat.v, lat.n, sizeof(*lat.v), cmp_double);
+	res[i].p50 = lat_pct(&lat, 50);
+	res[i].p99 = lat_pct(&lat, 99);
+    }
+    free(lat.v);
+}
+
+static void print_result(const char* workload, const char* target, const struct bench_result* r,
+			 const struct bench_result* raw){
+    char mbs[32];
+
+    if(r->failed){
+	printf("%-10s %-10s %s\n", workload, target, r->failed < 0 ? "skipped" : "FAILED");
+	return;
+    }
+    if(r->bytes > 0)
+	snprintf(mbs, sizeof(mbs), "%.1f", r->bytes / r->secs / 1e6);
+    else
+	snprintf(mbs, sizeof(mbs), "-");
+    printf("%-10s %-10s %8zu %10s %10.0f %10.1f %10.1f", workload, target, r->ops, mbs,
+	   r->ops / r->secs, r->p50 * 1e6, r->p99 * 1e6);
+    if(raw && !raw->failed && raw->secs > 0)
+	printf(" %8.2fx", r->secs / raw->secs);
+    printf("\n");
+}
+
+/* Run a command and wait for it, 0 if it exited with 0 */
+static int run_cmd(char* const argv[]){
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if(pid == -1)
+	return -1;
+    if(pid == 0){
+	execvp(argv[0], argv);
+	_exit(127);
+    }
+    if(waitpid(pid, &status, 0) == -1)
+	return -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/* Start pa4-encfs in the foreground and wait until mnt is a different filesystem */
+static pid_t mount_encfs(const char* prog, const char* mirror, const char* mnt, const char* opts){
+    struct stat parent;
+    struct stat st;
+    char* argv[8];
+    char parent_path[PATH_MAX];
+    pid_t pid;
+    int argc = 0;
+    int i;
+
+    snprintf(parent_path, sizeof(parent_path), "%s/..", mnt);
+    if(stat(parent_path, &parent) == -1)
+	return -1;
+
+    argv[argc++] = (char*) prog;
+    argv[argc++] = BENCH_KEY;
+    argv[argc++] = (char*) mirror;
+    argv[argc++] = (char*) mnt;
+    argv[argc++] = "-f";
+    if(opts){
+	argv[argc++] = "-o";
+	argv[argc++] = (char*) opts;
+    }
+    argv[argc] = NULL;
+
+    pid = fork();
+    if(pid == -1)
+	return -1;
+    if(pid == 0){
+	execv(prog, argv);
+	perror(prog);
+	_exit(127);
+    }
+
+    for(i = 0; i < BENCH_MOUNT_WAIT * 10; i++){
+	if(stat(mnt, &st) == 0 && st.st_dev != parent.st_dev)
+	    return pid;
+	if(waitpid(pid, NULL, WNOHANG) == pid)
+	    return -1;
+	usleep(100000);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void unmount_encfs(pid_t pid, const char* mnt){
+    char* argv[] = { "fusermount", "-u", (char*) mnt, NULL };
+
+    if(run_cmd(argv))
+	kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static int rm_tree(const char* path){
+    char* argv[] = { "rm", "-rf", (char*) path, NULL };
+
+    return run_cmd(argv);
+}
+
+int main(int argc, char* argv[]){
+    struct bench_target targets[3];
+    struct bench_result results[3][NWORKLOADS];
+    char scratch[PATH_MAX / 4];
+    char mirror[PATH_MAX / 4 + 16];
+    char mnt[PATH_MAX / 4 + 16];
+    const char* tmpdir = "/tmp";
+    char* opts = NULL;
+    char* prog;
+    int keep = 0;
+    int ntargets = 1;
+    int opt;
+    pid_t pid;
+    size_t i;
+    int j;
+
+    while((opt = getopt(argc, argv, "s:o:kt:")) != -1){
+	switch(opt){
+	case 's':
+	    scale = atoi(optarg);
+	    break;
+	case 'o':
+	    opts = optarg;
+	    break;
+	case 'k':
+	    keep = 1;
+	    break;
+	case 't':
+	    tmpdir = optarg;
+	    break;
+	default:
+	    fprintf(stderr, "usage: %s %s\n", argv[0], USAGE);
+	    return EXIT_FAILURE;
+	}
+    }
+    if(optind != argc - 1 || scale < 1){
+	fprintf(stderr, "usage: %s %s\n", argv[0], USAGE);
+	return EXIT_FAILURE;
+    }
+    prog = realpath(argv[optind], NULL);
+    if(!prog){
+	perror(argv[optind]);
+	return EXIT_FAILURE;
+    }
+
+    data = malloc(BENCH_COPY_BLOCK);
+    if(!data){
+	perror("malloc");
+	return EXIT_FAILURE;
+    }
+    srand(1);
+    for(i = 0; i < BENCH_COPY_BLOCK; i++)
+	data[i] = rand();
+
+    snprintf(scratch, sizeof(scratch), "%s/encfs-bench.XXXXXX", tmpdir);
+    if(!mkdtemp(scratch)){
+	perror(scratch);
+	return EXIT_FAILURE;
+    }
+    snprintf(mirror, sizeof(mirror), "%s/mirror", scratch);
+    snprintf(mnt, sizeof(mnt), "%s/mnt", scratch);
+
+    /* Raw baseline: the same workloads on the filesystem the mirror lives on */
+    targets[0].name = "raw";
+    snprintf(targets[0].dir, sizeof(targets[0].dir), "%s/raw", scratch);
+    strcpy(targets[0].setup, targets[0].dir);
+    targets[0].skip_create = 0;
+    if(make_dir(targets[0].dir) || make_dir(mirror) || make_dir(mnt))
+	return EXIT_FAILURE;
+    printf("scratch %s, scale %d, mount options %s\n", scratch, scale, opts ? opts : "(none)");
+    run_target(&targets[0], results[0]);
+
+    pid = mount_encfs(prog, mirror, mnt, opts);
+    if(pid == -1){
+	fprintf(stderr, "Mounting %s on %s failed, only the raw baseline is reported\n", prog, mnt);
+    }
+    else{
+	/* Files created through the mount are encrypted */
+	targets[1].name = "encrypted";
+	snprintf(targets[1].dir, sizeof(targets[1].dir), "%s/enc", mnt);
+	strcpy(targets[1].setup, targets[1].dir);
+	targets[1].skip_create = 0;
+	/* Files created in the mirror are not, and stay so when written through the mount */
+	targets[2].name = "plain";
+	snprintf(targets[2].dir, sizeof(targets[2].dir), "%s/plain", mnt);
+	snprintf(targets[2].setup, sizeof(targets[2].setup), "%s/plain", mirror);
+	targets[2].skip_create = 1;
+	if(make_dir(targets[1].dir) == 0 && make_dir(targets[2].setup) == 0){
+	    run_target(&targets[1], results[1]);
+	    run_target(&targets[2], results[2]);
+	    ntargets = 3;
+	}
+	unmount_encfs(pid, mnt);
+    }
+
+    printf("%-10s %-10s %8s %10s %10s %10s %10s %9s\n",
+	   "workload", "target", "ops", "MB/s", "ops/s", "p50 us", "p99 us", "vs raw");
+    for(i = 0; i < NWORKLOADS; i++){
+	for(j = 0; j < ntargets; j++)
+	    print_result(workloads[i].name, targets[j].name, &results[j][i], j ? &results[0][i] : NULL);
+    }
+
+    if(!keep)
+	rm_tree(scratch);
+    else
+	printf("kept %s\n", scratch);
+    free(prog);
+    free(data);
+    return ntargets == 3 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
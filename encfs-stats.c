@@ -0,0 +1,150 @@
+/* encfs-stats.c
+ * Per-operation counters and latency histograms for pa4-encfs
+ *
+ * Each operation's counters sit on their own cache lines so threads timing
+ * different operations do not contend. Counters are only ever added to (and
+ * max raised) with relaxed atomics; readers load them the same way.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "encfs-stats.h"
+
+#define ES_ALIGN 64
+
+/* The call count is the sum of the buckets */
+struct es_op {
+    uint64_t errors;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[ES_BUCKETS];
+} __attribute__((aligned(ES_ALIGN)));
+
+struct encfs_stats {
+    const char* const* names;
+    int nops;
+    struct es_op* ops;
+};
+
+extern struct encfs_stats* es_create(const char* const* names, int nops){
+    struct encfs_stats* es;
+
+    es = calloc(1, sizeof(*es));
+    if(!es)
+	return NULL;
+    if(posix_memalign((void**) &es->ops, ES_ALIGN, nops * sizeof(*es->ops))){
+	free(es);
+	return NULL;
+    }
+    memset(es->ops, 0, nops * sizeof(*es->ops));
+    es->names = names;
+    es->nops = nops;
+
+    return es;
+}
+
+extern void es_destroy(struct encfs_stats* es){
+    if(!es)
+	return;
+    free(es->ops);
+    free(es);
+}
+
+extern uint64_t es_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int es_bucket(uint64_t ns){
+    uint64_t us = ns / 1000;
+    int b;
+
+    if(us == 0)
+	return 0;
+    b = 64 - __builtin_clzll(us);
+    return b < ES_BUCKETS ? b : ES_BUCKETS - 1;
+}
+
+extern void es_record(struct encfs_stats* es, int op, uint64_t start, int failed){
+    struct es_op* o = &es->ops[op];
+    uint64_t ns = es_now() - start;
+    uint64_t max = __atomic_load_n(&o->max_ns, __ATOMIC_RELAXED);
+
+    if(failed)
+	__atomic_fetch_add(&o->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&o->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&o->buckets[es_bucket(ns)], 1, __ATOMIC_RELAXED);
+    while(ns > max &&
+	  !__atomic_compare_exchange_n(&o->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+}
+
+/* snprintf at the end of what buf holds so far, tracking the full length */
+static void es_append(char* buf, size_t size, size_t* len, const char* fmt, ...){
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(*len < size ? buf + *len : NULL, *len < size ? size - *len : 0, fmt, ap);
+    va_end(ap);
+    if(n > 0)
+	*len += n;
+}
+
+/* Upper bound in us of the bucket holding the pct'th percentile call */
+static uint64_t es_percentile(const uint64_t* buckets, uint64_t calls, int pct){
+    uint64_t want = (calls * pct + 99) / 100;
+    uint64_t seen = 0;
+    int b;
+
+    for(b = 0; b < ES_BUCKETS - 1; b++){
+	seen += buckets[b];
+	if(seen >= want)
+	    break;
+    }
+    return 1ULL << b;
+}
+
+extern size_t es_format(struct encfs_stats* es, char* buf, size_t size){
+    uint64_t buckets[ES_BUCKETS];
+    uint64_t calls;
+    uint64_t total;
+    size_t len = 0;
+    int op;
+    int b;
+
+    if(size > 0)
+	buf[0] = '\0';
+
+    for(op = 0; op < es->nops; op++){
+	struct es_op* o = &es->ops[op];
+
+	calls = 0;
+	for(b = 0; b < ES_BUCKETS; b++){
+	    buckets[b] = __atomic_load_n(&o->buckets[b], __ATOMIC_RELAXED);
+	    calls += buckets[b];
+	}
+	if(calls == 0)
+	    continue;
+	total = __atomic_load_n(&o->total_ns, __ATOMIC_RELAXED);
+
+	es_append(buf, size, &len, "%s calls=%llu errors=%llu total_us=%llu max_us=%llu"
+		  " p50_us=%llu p99_us=%llu hist=", es->names[op], (unsigned long long) calls,
+		  (unsigned long long) __atomic_load_n(&o->errors, __ATOMIC_RELAXED),
+		  (unsigned long long) total / 1000,
+		  (unsigned long long) __atomic_load_n(&o->max_ns, __ATOMIC_RELAXED) / 1000,
+		  (unsigned long long) es_percentile(buckets, calls, 50),
+		  (unsigned long long) es_percentile(buckets, calls, 99));
+	for(b = 0; b < ES_BUCKETS; b++)
+	    es_append(buf, size, &len, b ? ",%llu" : "%llu", (unsigned long long) buckets[b]);
+	es_append(buf, size, &len, "\n");
+    }
+
+    return len;
+}
@@ -0,0 +1,58 @@
+/* encfs-stats.h
+ * Per-operation counters and latency histograms for pa4-encfs
+ *
+ * Every operation has a call count, an error count, the total and largest
+ * latency and a histogram of latencies in power-of-two microsecond buckets.
+ * Recording a call is a few relaxed atomic adds on the operation's own
+ * counters, so all FUSE threads record without taking a lock. A snapshot
+ * taken while calls are being recorded may miss the calls in flight.
+ */
+
+#ifndef ENCFS_STATS_H
+#define ENCFS_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bucket 0 counts calls under 1 us, bucket b calls of [2^(b-1), 2^b) us and
+ * the last bucket everything slower (over about 4 s) */
+#define ES_BUCKETS 24
+
+struct encfs_stats;
+
+/* struct encfs_stats* es_create(const char* const* names, int nops)
+ * Purpose: Create zeroed counters for nops operations
+ * Args: const char* const* names : Name of each operation, used by es_format; the
+ *                                  array must outlive the counters
+ *       int nops                 : Number of operations, indexes 0..nops-1
+ * Return: New counters, NULL on allocation failure
+ */
+extern struct encfs_stats* es_create(const char* const* names, int nops);
+
+/* void es_destroy(struct encfs_stats* es)
+ * Purpose: Free the counters
+ */
+extern void es_destroy(struct encfs_stats* es);
+
+/* uint64_t es_now(void)
+ * Purpose: Monotonic clock in nanoseconds, for the start time passed to es_record
+ */
+extern uint64_t es_now(void);
+
+/* void es_record(struct encfs_stats* es, int op, uint64_t start, int failed)
+ * Purpose: Count one call of op that started at start (from es_now) and ends now
+ * Args: int failed : Non-zero if the call returned an error
+ */
+extern void es_record(struct encfs_stats* es, int op, uint64_t start, int failed);
+
+/* size_t es_format(struct encfs_stats* es, char* buf, size_t size)
+ * Purpose: Write one line per operation called so far:
+ *          "<name> calls=N errors=N total_us=N max_us=N p50_us=N p99_us=N hist=b0,b1,..."
+ *          Percentiles are the upper bound of the bucket they fall in.
+ * Args: char* buf   : Output, NUL terminated and truncated like snprintf
+ *       size_t size : Size of buf, may be 0
+ * Return: Length of the full text, excluding the NUL
+ */
+extern size_t es_format(struct encfs_stats* es, char* buf, size_t size);
+
+#endif
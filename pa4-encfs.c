@@ -1,9 +1,13 @@
-/* This file is a FUSE executable. It creates a mounted directory of a mirror directory found 
-*	in the command arguments.  It also uses a passphrase to encrypt a decrypt files using 
+/* This file is a FUSE executable. It creates a mounted directory of a mirror directory found
+*	in the command arguments.  It also uses a passphrase to encrypt a decrypt files using
 *	AES encryption with OpenSSL libcrypto EVP API and FUSE filesystem.
 *	Command Line Usage: "Usage: ./pa4-encfs <passphrase> <mirror_directory> <mount_point>
+*
+*	It is written against the FUSE low-level API: the kernel names files by inode
+*	number, and each inode number is a node holding an O_PATH descriptor of the
+*	backing file, so operations work relative to descriptors and never build paths.
 */
-  
+
 
 
 #define FUSE_USE_VERSION 28
@@ -19,11 +23,12 @@
 #define ENCRYPTED "true"
 #define UNENCRYPTED "false"
 
-/* File suffixes for the tmp_path function to distinguish which function is calling it*/
-#define SUFFIXGETATTR ".getattr"
-#define SUFFIXREAD ".read"
-#define SUFFIXWRITE ".write"
-#define SUFFIXCREATE ".create"
+/* Plaintext length of an encrypted file, stored as a decimal string so getattr never has to decrypt */
+#define XATRR_PLAIN_SIZE "user.pa4-encfs.size"
+
+/* Read-only attribute of the mount root holding the counters of xmp_format_stats.
+ * It is answered by pa4-encfs itself and not listed by listxattr. */
+#define XATRR_STATS "user.pa4-encfs.stats"
 
 #ifdef linux
 /* Linux is missing ENOATTR error, using ENODATA instead */
@@ -36,12 +41,13 @@
 #endif
 
 #ifdef linux
-/* For pread()/pwrite() and open_memstream */
-#define _XOPEN_SOURCE 700
+/* For pread()/pwrite(), O_PATH and the *at calls */
+#define _GNU_SOURCE
 #endif
 
 //#define HAVE_SETXATTR
-#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -50,9 +56,14 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/resource.h>
 #include <stddef.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
 
 
 
@@ -62,708 +73,2682 @@
 
 /* This if for the do_crypt function */
 #include "aes-crypt.h"
+/* Chunked encrypted file format */
+#include "crypt-file.h"
+/* Cache of decrypted chunks */
+#include "block-cache.h"
+/* Leveled logging, compiled out above ENCFS_LOG_MAX */
+#include "encfs-log.h"
+/* Per-inode cache of the encrypted flag and plaintext size */
+#include "attr-cache.h"
+
+#include "encfs-stats.h"
 
 /* Define command line usage of file */
-#define USAGE "Usage:\n\t./fusexmp <passphrase> <mirror_directory> <mount_point>\n"
+#define USAGE "Usage:\n\t./fusexmp <passphrase> <mirror_directory> <mount_point> [FUSE options]\n" \
+	"Options:\n" \
+	"\t-o cache_mb=N\tmemory for decrypted chunks in MiB, 0 disables (default 32)\n" \
+	"\t-o cipher=NAME\tcipher for new files, ctr (default) or cbc\n" \
+	"\t-o crypt_threads=N\tthreads encrypting one large request, 0 one per CPU (default), 1 off\n" \
+	"\t-o crypt_min_kb=N\tsmallest request spread over those threads in KiB (default 128)\n" \
+	"\t-o log_level=N\t0 errors, 1 warnings, 2 info, 3 debug, 4 trace (default 1, 3 with -d)\n" \
+	"\t-o attr_timeout=T\tseconds the kernel caches attributes (default 1.0)\n" \
+	"\t-o entry_timeout=T\tseconds the kernel caches names (default 1.0)\n" \
+	"\t-o negative_timeout=T\tseconds the kernel caches missing names (default 0)\n" \
+	"\t-o writeback_kb=N\tencrypted writes buffered per open file in KiB, 0 disables (default 1024)\n" \
+	"\t-o writeback_ms=N\twrite buffered data out after this many milliseconds (default 1000)\n" \
+	"\t-o readahead_kb=N\tdecrypt this far ahead of sequential readers into the chunk cache, 0 disables (default 512)\n" \
+	"\t-o kernel_cache\tkeep cached file contents across opens\n" \
+	"\t-o auto_cache\tkeep them unless the mirror file changed since it was last closed\n" \
+	"\t(max_write=N, max_readahead=N, async_read and sync_read are passed to FUSE)\n" \
+	"Every file and directory the kernel has looked up holds one open descriptor until the\n" \
+	"kernel forgets it; the open file limit is raised to the hard limit (ulimit -Hn) at start.\n"
+
+/* Default budget of the decrypted chunk cache */
+#define XMP_CACHE_MB 32
+
+/* Requests from this size on are encrypted by several threads */
+#define XMP_CRYPT_MIN_KB 128
+
+/* Write-back buffer of an open encrypted file, the age at which the timer writes
+*	it out, and the total over all files above which writers flush their own at once
+*/
+#define XMP_WB_KB 1024
+#define XMP_WB_MS 1000
+#define XMP_WB_TOTAL_MB 64
 
-#define XMP_DATA ((struct xmp_state *) fuse_get_context()->private_data)
+/* Readahead window of a sequential reader, the sequential reads it takes to
+*	start it, and the chunks the readahead thread decrypts per cf_pread
+*/
+#define XMP_RA_KB 512
+#define XMP_RA_MIN_SEQ 2
+#define XMP_RA_BATCH 32
+
+/* Inodes whose encrypted flag and plaintext size getattr keeps in memory. readdir
+ * fills in a directory ahead of the lookups that follow (ls -l), so this is sized
+ * for large directories (about 3 MiB). */
+#define XMP_ATTR_SLOTS 65536
+
+/* Seconds the kernel may trust the attributes and names we return, the
+*	defaults of the high-level API; -o attr_timeout= etc. change them
+*/
+#define XMP_ATTR_TIMEOUT 1.0
+#define XMP_ENTRY_TIMEOUT 1.0
+#define XMP_NEGATIVE_TIMEOUT 0.0
+
+/* Initial buckets of the node table, doubled as it fills */
+#define XMP_INODE_BUCKETS 256
+
+/* Room for "/proc/self/fd/<int>" */
+#define XMP_PROC_PATH 32
+
+/* Largest stats text; XATRR_STATS size queries are answered with room to spare
+ * since the counters can grow before the value itself is read */
+#define XMP_STATS_MAX 65536
+#define XMP_STATS_SLACK 4096
+
+/* A backing file the kernel knows by inode number.
+*	The FUSE inode number is the address of the node, so every operation finds
+*	its node in O(1); the node owns an O_PATH descriptor the operation works
+*	relative to. Nodes live until the kernel forgets every lookup of them.
+*
+*	Encrypted files also keep their chunk geometry and plaintext size here while
+*	open. read holds lock shared, write and truncate hold it exclusive, so chunks
+*	are never read half rewritten and the size, header and cache stay consistent.
+*/
+struct xmp_inode {
+    dev_t dev;
+    ino_t ino;
+    mode_t type;               /* S_IFMT bits of the backing file */
+    int fd;                    /* O_PATH descriptor of the backing file */
+    uint64_t nlookup;          /* kernel references, protected by the table lock */
+    struct xmp_inode *next;    /* hash chain */
+    pthread_rwlock_t lock;
+    int opens;                 /* open encrypted handles */
+    int loaded;                /* header and size below have been read */
+    int chunked;               /* chunked format, otherwise legacy whole-file CBC */
+    struct cf_header hdr;      /* chunk geometry when chunked */
+    off_t size;                /* plaintext size on disk, see xmp_inode_end */
+    struct xmp_file *dirty;    /* handle holding buffered writes, NULL if none */
+    int cached;                /* the three below are set, see xmp_keep_cache */
+    struct timespec cached_mtime; /* backing file when the last handle closed */
+    struct timespec cached_ctime;
+    off_t cached_size;
+    int chunks_valid;          /* chunk cache entries match the file as of chunks_ctime */
+    struct timespec chunks_ctime; /* backing file when the last encrypted handle closed */
+    unsigned long lookups;     /* of names in this directory, see xmp_readdir */
+};
 
 struct xmp_state {
-    char *mirror_dir;
+    char *mirror_dir;          /* as given, only for messages; see root */
     char *key_phrase;
+    struct aes_key key; /* derived from key_phrase once at mount */
+    struct block_cache *cache; /* decrypted chunks, NULL when disabled */
+    struct attr_cache *attrs;  /* encrypted flag and size per inode */
+    int cipher;                /* CF_CIPHER_* for new and converted files */
+    struct xmp_inode *root;    /* the mirror directory, FUSE_ROOT_ID */
+    pthread_mutex_t inode_lock; /* guards the table below */
+    struct xmp_inode **inodes; /* nodes by backing (dev, ino) */
+    size_t inode_buckets;      /* power of two */
+    size_t ninodes;
+    double attr_timeout;       /* seconds, see XMP_ATTR_TIMEOUT */
+    double entry_timeout;
+    double negative_timeout;   /* 0: the kernel looks missing names up every time */
+    int kernel_cache;          /* file contents stay cached across opens */
+    int auto_cache;            /* ... as long as the backing file is unchanged */
+    struct fuse_chan *ch;      /* for telling the kernel to drop what it cached */
+    size_t wb_max;             /* write-back buffer per handle, 0 disables it */
+    long wb_delay_ms;          /* age at which the timer writes a buffer out */
+    pthread_mutex_t wb_lock;   /* guards the fields below */
+    pthread_cond_t wb_cond;    /* wakes the timer */
+    struct xmp_file *wb_head;  /* dirty handles, oldest first */
+    struct xmp_file *wb_tail;
+    size_t wb_bytes;           /* buffered over all handles */
+    int wb_stop;
+    int wb_running;            /* wb_thread was started */
+    pthread_t wb_thread;
+    off_t ra_chunks;           /* readahead window in chunks, 0 disables it */
+    pthread_mutex_t ra_lock;   /* guards the fields below and the ra_ fields of handles */
+    pthread_cond_t ra_cond;    /* work queued, or a handle finished */
+    struct xmp_file *ra_head;  /* handles with chunks to prefetch, in order */
+    struct xmp_file *ra_tail;
+    struct xmp_file *ra_active; /* handle the readahead thread works for */
+    int ra_stop;
+    int ra_running;            /* ra_thread was started */
+    pthread_t ra_thread;
+    struct encfs_stats *stats; /* per-operation counters, see xmp_oper */
 };
 
-/* This is function that creates physical temporary file
-*	Credit to Alex Beal for this function
- */
-char* tmp_path(const char* old_path, const char *suffix){
-    char* new_path;
-    int len=0;
-    len=strlen(old_path) + strlen(suffix) + 1;
-    new_path = malloc(sizeof(char)*len);
-    if(new_path == NULL){
-        return NULL;
-    }
-    new_path[0] = '\0';
-    strcat(new_path, old_path);
-    strcat(new_path, suffix);
-    return new_path;
-}
+/* Mount state, set up by main before the session starts */
+static struct xmp_state *xmp_data;
+
+#define XMP_DATA xmp_data
+
+/* Operations timed in XMP_DATA->stats, one per request handler in xmp_oper */
+enum xmp_op {
+	XMP_OP_LOOKUP,
+	XMP_OP_FORGET,
+	XMP_OP_FORGET_MULTI,
+	XMP_OP_GETATTR,
+	XMP_OP_SETATTR,
+	XMP_OP_ACCESS,
+	XMP_OP_READLINK,
+	XMP_OP_OPENDIR,
+	XMP_OP_READDIR,
+	XMP_OP_RELEASEDIR,
+	XMP_OP_MKNOD,
+	XMP_OP_MKDIR,
+	XMP_OP_SYMLINK,
+	XMP_OP_UNLINK,
+	XMP_OP_RMDIR,
+	XMP_OP_RENAME,
+	XMP_OP_LINK,
+	XMP_OP_OPEN,
+	XMP_OP_READ,
+	XMP_OP_WRITE_BUF,
+	XMP_OP_STATFS,
+	XMP_OP_CREATE,
+	XMP_OP_FLUSH,
+	XMP_OP_RELEASE,
+	XMP_OP_FSYNC,
+	XMP_OP_SETXATTR,
+	XMP_OP_GETXATTR,
+	XMP_OP_LISTXATTR,
+	XMP_OP_REMOVEXATTR,
+	XMP_NOPS
+};
+
+static const char *const xmp_op_names[XMP_NOPS] = {
+	[XMP_OP_LOOKUP] = "lookup",
+	[XMP_OP_FORGET] = "forget",
+	[XMP_OP_FORGET_MULTI] = "forget_multi",
+	[XMP_OP_GETATTR] = "getattr",
+	[XMP_OP_SETATTR] = "setattr",
+	[XMP_OP_ACCESS] = "access",
+	[XMP_OP_READLINK] = "readlink",
+	[XMP_OP_OPENDIR] = "opendir",
+	[XMP_OP_READDIR] = "readdir",
+	[XMP_OP_RELEASEDIR] = "releasedir",
+	[XMP_OP_MKNOD] = "mknod",
+	[XMP_OP_MKDIR] = "mkdir",
+	[XMP_OP_SYMLINK] = "symlink",
+	[XMP_OP_UNLINK] = "unlink",
+	[XMP_OP_RMDIR] = "rmdir",
+	[XMP_OP_RENAME] = "rename",
+	[XMP_OP_LINK] = "link",
+	[XMP_OP_OPEN] = "open",
+	[XMP_OP_READ] = "read",
+	[XMP_OP_WRITE_BUF] = "write_buf",
+	[XMP_OP_STATFS] = "statfs",
+	[XMP_OP_CREATE] = "create",
+	[XMP_OP_FLUSH] = "flush",
+	[XMP_OP_RELEASE] = "release",
+	[XMP_OP_FSYNC] = "fsync",
+	[XMP_OP_SETXATTR] = "setxattr",
+	[XMP_OP_GETXATTR] = "getxattr",
+	[XMP_OP_LISTXATTR] = "listxattr",
+	[XMP_OP_REMOVEXATTR] = "removexattr",
+};
+
+/* Set when the handler running on this thread answers with an error */
+static __thread int xmp_req_failed;
 
-/* Function for changing paths of all the functions to the specific mirror directory instead of root */
-static void xmp_fullpath(char fpath[PATH_MAX], const char *path)
+/* fuse_reply_err, noting errors for the handler's entry in XMP_DATA->stats */
+static void xmp_reply_err(fuse_req_t req, int err)
 {
-    strcpy(fpath, XMP_DATA->mirror_dir);
-    strncat(fpath, path, PATH_MAX); 
+	if (err)
+		xmp_req_failed = 1;
+	fuse_reply_err(req, err);
 }
 
-/* This function gets certain characteristics of a file like size and stores them in a struct called stat */
-static int xmp_getattr(const char *path, struct stat *stbuf)
-{
-	int res;
-	int crypt_action = PASS_THROUGH;
-	ssize_t valsize = 0;
-	char *tmpval = NULL;
+/* Mount options understood by pa4-encfs, everything else goes to FUSE */
+struct xmp_config {
+    unsigned int cache_mb;
+    char *cipher;
+    int crypt_threads;
+    unsigned int crypt_min_kb;
+    int log_level;             /* -1 unless given */
+    int debug;                 /* -d was passed, FUSE still sees it */
+    double attr_timeout;
+    double entry_timeout;
+    double negative_timeout;
+    int kernel_cache;
+    int auto_cache;
+    unsigned int writeback_kb;
+    unsigned int writeback_ms;
+    unsigned int readahead_kb;
+};
 
+#define XMP_OPT(t, p) { t, offsetof(struct xmp_config, p), 0 }
+/* Options without a value: fuse_opt stores the last field, so giving one sets it to 1 */
+#define XMP_FLAG(t, p) { t, offsetof(struct xmp_config, p), 1 }
+
+static const struct fuse_opt xmp_opts[] = {
+	XMP_OPT("cache_mb=%u", cache_mb),
+	XMP_OPT("cipher=%s", cipher),
+	XMP_OPT("crypt_threads=%d", crypt_threads),
+	XMP_OPT("crypt_min_kb=%u", crypt_min_kb),
+	XMP_OPT("log_level=%d", log_level),
+	XMP_OPT("attr_timeout=%lf", attr_timeout),
+	XMP_OPT("entry_timeout=%lf", entry_timeout),
+	XMP_OPT("negative_timeout=%lf", negative_timeout),
+	XMP_OPT("writeback_kb=%u", writeback_kb),
+	XMP_OPT("writeback_ms=%u", writeback_ms),
+	XMP_OPT("readahead_kb=%u", readahead_kb),
+	XMP_FLAG("kernel_cache", kernel_cache),
+	XMP_FLAG("auto_cache", auto_cache),
+	XMP_FLAG("-d", debug),
+	XMP_FLAG("debug", debug),
+	FUSE_OPT_KEY("-d", FUSE_OPT_KEY_KEEP),
+	FUSE_OPT_KEY("debug", FUSE_OPT_KEY_KEEP),
+	FUSE_OPT_END
+};
 
-	time_t    atime;   /* time of last access */
-    time_t    mtime;   /* time of last modification */
-    time_t    tctime;   /* time of last status change */
-    dev_t     t_dev;     /* ID of device containing file */
-    ino_t     t_ino;     /* inode number */
-    mode_t    mode;    /* protection */
-    nlink_t   t_nlink;   /* number of hard links */
-    uid_t     t_uid;     /* user ID of owner */
-    gid_t     t_gid;     /* group ID of owner */
-    dev_t     t_rdev;    /* device ID (if special file) */
-	
+/* Per-open state, allocated by open/create and kept in fuse_file_info->fh so
+*	read and write never have to look at the node's xattrs again.
+*
+*	Small writes to an encrypted file are collected in wb, one contiguous run of
+*	plaintext, and encrypted together when it is written out (see xmp_wb_flush).
+*	At most one handle of a node holds buffered data, node->dirty, so reads only
+*	have one buffer to look at. wb and its size are protected by node->lock.
+*/
+struct xmp_file {
+    int fd;                    /* backing file in the mirror directory */
+    int encrypted;             /* file carries the encrypted flag */
+    int writable;              /* opened for writing */
+    struct xmp_inode *node;    /* node the file was opened through */
+    const struct aes_key *key; /* mount key, derived once in main */
+    char *wb;                  /* plaintext not written out yet */
+    off_t wb_off;              /* file offset of wb[0] */
+    size_t wb_len;
+    size_t wb_cap;
+    int wb_err;                /* a timer write-out failed, reported by the next flush */
+    struct timespec wb_since;  /* CLOCK_MONOTONIC when wb became dirty */
+    struct xmp_file *wb_prev;  /* XMP_DATA->wb_head list, under wb_lock */
+    struct xmp_file *wb_next;
+    off_t ra_next;             /* offset a sequential read continues at, under ra_lock */
+    int ra_seq;                /* sequential reads in a row */
+    off_t ra_end;              /* chunks before this one have been queued */
+    off_t ra_first;            /* chunks queued for the readahead thread */
+    off_t ra_last;
+    int ra_queued;             /* on the XMP_DATA->ra_head list */
+    int ra_cancel;             /* being released, the thread should stop early */
+    struct xmp_file *ra_qnext;
+};
 
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
+#define XMP_FILE(fi) ((struct xmp_file *) (uintptr_t) (fi)->fh)
 
-	res = lstat(fpath, stbuf);
-	if (res == -1){
-			return -errno;
-	}
-	
-	/* is it a regular file? */
-	if (S_ISREG(stbuf->st_mode)){
-
-		/* These file characteristics don't change after decryption so just storing them */
-		atime = stbuf->st_atime;
-		mtime = stbuf->st_mtime;
-		tctime = stbuf->st_ctime;
-		t_dev = stbuf->st_dev;
-		t_ino = stbuf->st_ino;
-		mode = stbuf->st_mode;
-		t_nlink = stbuf->st_nlink;
-		t_uid = stbuf->st_uid;
-		t_gid = stbuf->st_gid;
-		t_rdev = stbuf->st_rdev;
-
-
-		/* Get size of flag value and value itself */
-		valsize = getxattr(fpath, XATRR_ENCRYPTED_FLAG, NULL, 0);
-		tmpval = malloc(sizeof(*tmpval)*(valsize));
-		valsize = getxattr(fpath, XATRR_ENCRYPTED_FLAG, tmpval, valsize);
-		
-		//fprintf(stderr, "Xattr Value: %s\nXattr size: %zu\n", tmpval, sizeof(*tmpval)*(valsize));
-		fprintf(stderr, "Xattr Value: %s\n", tmpval);
-
-		/* If the specified attribute doesn't exist or it's set to false */
-		if (valsize < 0 || memcmp(tmpval, "false", 5) == 0){
-			if(errno == ENOATTR){
-				fprintf(stderr, "No %s attribute set\n", XATRR_ENCRYPTED_FLAG);
-			}
-			//fprintf(stderr, "file is unencrypted, leaving crypt_action as pass-through\n valsize is %zu\n", valsize);
-			fprintf(stderr, "file is unencrypted, leaving crypt_action as pass-through\n");
-
-		} /* If the attribute exists and is true then we need to get size of decrypted file */
-		else if (memcmp(tmpval, "true", 4) == 0){
-			//fprintf(stderr, "file is encrypted, need to decrypt\nvalsize is %zu\n", valsize);
-			fprintf(stderr, "file is encrypted, need to decrypt\n");
-			crypt_action = DECRYPT;
-		}
+/* Open directory, kept in fuse_file_info->fh between opendir and releasedir */
+struct xmp_dir {
+    DIR *dp;
+    struct dirent *entry;      /* read but not returned yet, it did not fit the last reply */
+    off_t offset;              /* position of dp as the kernel knows it */
+    unsigned long lookups;     /* the directory's lookups as of the last reply */
+};
 
-		const char *tmpPath = tmp_path(fpath, SUFFIXGETATTR);
-		FILE *tmpFile = fopen(tmpPath, "wb+");
-		FILE *f = fopen(fpath, "rb");
+#define XMP_DIR(fi) ((struct xmp_dir *) (uintptr_t) (fi)->fh)
 
-		fprintf(stderr, "fpath: %s\ntmpPath: %s\n", fpath, tmpPath);
 
-		if(!do_crypt(f, tmpFile, crypt_action, XMP_DATA->key_phrase)){
-		fprintf(stderr, "getattr do_crypt failed\n");
-    	}
+/* Path that reopens a node's O_PATH descriptor, for the calls that have no *at form */
+static void xmp_proc_path(char procpath[XMP_PROC_PATH], const struct xmp_inode *node)
+{
+	snprintf(procpath, XMP_PROC_PATH, "/proc/self/fd/%d", node->fd);
+}
 
-		fclose(f);
-		fclose(tmpFile);
+/* Returns 1 if the file carries the encrypted flag set to true, 0 otherwise */
+static int xmp_is_encrypted(const char *fpath)
+{
+	char val[8];
+	ssize_t valsize;
 
-		/* Get size of decrypted file and store in stat struct */
-		res = lstat(tmpPath, stbuf);
-		if (res == -1){
-			return -errno;
-		}
+	valsize = getxattr(fpath, XATRR_ENCRYPTED_FLAG, val, sizeof(val));
+	if (valsize < 4 || memcmp(val, ENCRYPTED, 4) != 0)
+		return 0;
 
-		/* Put info about file we did not want to change back into stat struct*/
-		stbuf->st_atime = atime;
-		stbuf->st_mtime = mtime;
-		stbuf->st_ctime = tctime;
-		stbuf->st_dev = t_dev;
-		stbuf->st_ino = t_ino;
-		stbuf->st_mode = mode;
-		stbuf->st_nlink = t_nlink;
-		stbuf->st_uid = t_uid;
-		stbuf->st_gid = t_gid;
-		stbuf->st_rdev = t_rdev;
+	return 1;
+}
 
-		free(tmpval);
-		remove(tmpPath);
-	}
+/* Parse the decimal plaintext size read from XATRR_PLAIN_SIZE */
+static int xmp_parse_size(char *val, ssize_t valsize, off_t *size)
+{
+	char *end;
+	long long n;
+
+	if (valsize < 0)
+		return -errno;
+	val[valsize] = '\0';
 
-		
+	n = strtoll(val, &end, 10);
+	if (end == val || n < 0)
+		return -EINVAL;
 
+	*size = n;
 	return 0;
 }
 
-static int xmp_access(const char *path, int mask)
+/* Read the plaintext size recorded for an encrypted file.
+*	Returns 0 on success or -errno if the attribute is missing or unreadable
+*/
+static int xmp_get_size(const char *fpath, off_t *size)
 {
-	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = access(fpath, mask);
-	if (res == -1)
-		return -errno;
+	char val[32];
 
-	return 0;
+	return xmp_parse_size(val, getxattr(fpath, XATRR_PLAIN_SIZE, val, sizeof(val) - 1), size);
 }
 
-static int xmp_readlink(const char *path, char *buf, size_t size)
+/* Same as xmp_get_size for an already open backing file */
+static int xmp_fget_size(int fd, off_t *size)
 {
-	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = readlink(fpath, buf, size - 1);
-	if (res == -1)
-		return -errno;
+	char val[32];
 
-	buf[res] = '\0';
-	return 0;
+	return xmp_parse_size(val, fgetxattr(fd, XATRR_PLAIN_SIZE, val, sizeof(val) - 1), size);
 }
 
-
-static int xmp_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+/* Record the plaintext size of an encrypted file next to its encrypted flag */
+static int xmp_set_size(int fd, off_t size)
 {
-	DIR *dp;
-	struct dirent *de;
+	char val[32];
+	int len;
 
-	(void) offset;
-	(void) fi;
-
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	dp = opendir(fpath);
-	if (dp == NULL)
+	len = snprintf(val, sizeof(val), "%lld", (long long) size);
+	if (fsetxattr(fd, XATRR_PLAIN_SIZE, val, len, 0) == -1)
 		return -errno;
 
-	while ((de = readdir(dp)) != NULL) {
-		struct stat st;
-		memset(&st, 0, sizeof(st));
-		st.st_ino = de->d_ino;
-		st.st_mode = de->d_type << 12;
-		if (filler(buf, de->d_name, &st, 0))
-			break;
-	}
-
-	closedir(dp);
 	return 0;
 }
 
-static int xmp_mknod(const char *path, mode_t mode, dev_t rdev)
+/* Work out the plaintext size of a file whose size attribute is missing.
+*	Legacy files only need their last cipher block decrypted to read the padding,
+*	which gives the exact size, so it is stored and later calls are a single
+*	getxattr. Chunked files are sized from their slot layout, which can only
+*	bound the size: the zero padding of the last chunk looks like plaintext.
+*	That bound is returned with a warning but not stored as if it were exact;
+*	only a later write or truncate records a size for the file again.
+*/
+static int xmp_recover_size(struct xmp_inode *node, int fd, off_t *size)
 {
 	int res;
+	struct stat st;
+	struct cf_header hdr;
 
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
-	   is more portable */
-	if (S_ISREG(mode)) {
-		res = open(fpath, O_CREAT | O_EXCL | O_WRONLY, mode);
-		if (res >= 0)
-			res = close(res);
-	} else if (S_ISFIFO(mode))
-		res = mkfifo(fpath, mode);
-	else
-		res = mknod(fpath, mode, rdev);
-	if (res == -1)
-		return -errno;
+	res = cf_read_header(fd, &hdr);
+	if (res == 1) {
+		if (fstat(fd, &st) == -1)
+			return -errno;
+		*size = cf_plain_bound(&hdr, st.st_size);
+		log_warn("inode %llu has lost its size attribute, reading it as %lld bytes,"
+			 " which may include up to %d bytes of padding",
+			 (unsigned long long) node->ino, (long long) *size, AES_BLOCK_SIZE - 1);
+		return 0;
+	}
+	if (res < 0)
+		return res;
 
+	*size = do_crypt_plain_size(fd, &XMP_DATA->key);
+	if (*size < 0)
+		return *size;
+	xmp_set_size(fd, *size);
 	return 0;
 }
 
-static int xmp_mkdir(const char *path, mode_t mode)
+/* Convert a legacy whole-file CBC file to the chunked format so it can be changed in place.
+*	This happens once per file, so the plaintext is simply held in memory while the
+*	file is rewritten.
+*/
+static int xmp_migrate_legacy(int fd, const struct aes_key *key)
 {
 	int res;
+	struct stat st;
+	struct cf_header hdr;
+	unsigned char *cipher;
+	unsigned char *plain;
+	size_t plainlen = 0;
+	ssize_t got;
+	off_t size = 0;
+
+	if (fstat(fd, &st) == -1)
+		return -errno;
 
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
+	cipher = malloc(st.st_size + 1);
+	plain = malloc(st.st_size + AES_BLOCK_SIZE);
+	if (cipher == NULL || plain == NULL) {
+		free(cipher);
+		free(plain);
+		return -ENOMEM;
+	}
 
-	res = mkdir(fpath, mode);
-	if (res == -1)
-		return -errno;
+	res = 0;
+	got = pread(fd, cipher, st.st_size, 0);
+	if (got != st.st_size)
+		res = got < 0 ? -errno : -EIO;
+	else if (got > 0 && !do_crypt_buf(cipher, got, plain, &plainlen, DECRYPT, key))
+		res = -EIO;
+
+	if (res == 0 && ftruncate(fd, 0) == -1)
+		res = -errno;
+	if (res == 0) {
+		cf_init_header(&hdr, CF_DEFAULT_CHUNK, XMP_DATA->cipher);
+		res = cf_write_header(fd, &hdr);
+	}
+	if (res == 0 && plainlen > 0) {
+		res = cf_pwrite(fd, &hdr, key, (const char *) plain, plainlen, 0, &size);
+		if (res > 0)
+			res = 0;
+	}
+	if (res == 0)
+		res = xmp_set_size(fd, plainlen);
 
-	return 0;
+	free(cipher);
+	free(plain);
+	return res;
 }
 
-static int xmp_unlink(const char *path)
+/* Bucket of a backing (dev, ino) pair in a table of nbuckets */
+static size_t xmp_inode_hash(dev_t dev, ino_t ino, size_t nbuckets)
 {
-	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
+	uint64_t h = (uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t) dev;
 
-	res = unlink(fpath);
-	if (res == -1)
-		return -errno;
+	return (h ^ (h >> 32)) & (nbuckets - 1);
+}
 
-	return 0;
+/* Double the node table. Called with the table lock held; if memory is short
+*	the chains just get longer.
+*/
+static void xmp_inode_grow(struct xmp_state *state)
+{
+	size_t nbuckets = state->inode_buckets * 2;
+	struct xmp_inode **buckets;
+	struct xmp_inode *node;
+	struct xmp_inode *next;
+	size_t i;
+	size_t h;
+
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (buckets == NULL)
+		return;
+
+	for (i = 0; i < state->inode_buckets; i++) {
+		for (node = state->inodes[i]; node; node = next) {
+			next = node->next;
+			h = xmp_inode_hash(node->dev, node->ino, nbuckets);
+			node->next = buckets[h];
+			buckets[h] = node;
+		}
+	}
+	free(state->inodes);
+	state->inodes = buckets;
+	state->inode_buckets = nbuckets;
 }
 
-static int xmp_rmdir(const char *path)
+/* Find the node of a backing file, adding one that takes over fd if there is none.
+*	Counts one kernel lookup. When the node already exists fd is closed.
+*/
+static struct xmp_inode *xmp_inode_get(const struct stat *st, int fd)
 {
-	int res;
+	struct xmp_state *state = XMP_DATA;
+	struct xmp_inode **bucket;
+	struct xmp_inode *node;
+
+	pthread_mutex_lock(&state->inode_lock);
+	bucket = &state->inodes[xmp_inode_hash(st->st_dev, st->st_ino, state->inode_buckets)];
+	for (node = *bucket; node; node = node->next)
+		if (node->ino == st->st_ino && node->dev == st->st_dev)
+			break;
 
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = rmdir(fpath);
-	if (res == -1)
-		return -errno;
+	if (node != NULL) {
+		close(fd);
+	} else {
+		node = calloc(1, sizeof(*node));
+		if (node != NULL && pthread_rwlock_init(&node->lock, NULL) != 0) {
+			free(node);
+			node = NULL;
+		}
+		if (node != NULL) {
+			node->dev = st->st_dev;
+			node->ino = st->st_ino;
+			node->type = st->st_mode & S_IFMT;
+			node->fd = fd;
+			node->next = *bucket;
+			*bucket = node;
+			if (++state->ninodes > state->inode_buckets)
+				xmp_inode_grow(state);
+		}
+	}
+	if (node != NULL)
+		node->nlookup++;
+	pthread_mutex_unlock(&state->inode_lock);
 
-	return 0;
+	return node;
 }
 
-static int xmp_symlink(const char *from, const char *to)
+/* Drop n kernel lookups; the node and its descriptor go away with the last one */
+static void xmp_inode_unref(struct xmp_inode *node, uint64_t n)
 {
-	int res;
-	/* change path to specific mirror directory instead of root */
-	char fto[PATH_MAX];
-	xmp_fullpath(fto, to);
-	res = symlink(from, fto);
-	if (res == -1)
-		return -errno;
+	struct xmp_state *state = XMP_DATA;
+	struct xmp_inode **pp;
+
+	pthread_mutex_lock(&state->inode_lock);
+	node->nlookup -= n < node->nlookup ? n : node->nlookup;
+	if (node->nlookup > 0) {
+		pthread_mutex_unlock(&state->inode_lock);
+		return;
+	}
+	pp = &state->inodes[xmp_inode_hash(node->dev, node->ino, state->inode_buckets)];
+	while (*pp != node)
+		pp = &(*pp)->next;
+	*pp = node->next;
+	state->ninodes--;
+	pthread_mutex_unlock(&state->inode_lock);
+
+	close(node->fd);
+	pthread_rwlock_destroy(&node->lock);
+	free(node);
+}
 
-	return 0;
+/* The node behind a FUSE inode number */
+static struct xmp_inode *xmp_inode(fuse_ino_t ino)
+{
+	if (ino == FUSE_ROOT_ID)
+		return XMP_DATA->root;
+	return (struct xmp_inode *) (uintptr_t) ino;
 }
 
-static int xmp_rename(const char *from, const char *to)
+/* Plaintext size including writes still buffered. Called with node->lock held. */
+static off_t xmp_inode_end(const struct xmp_inode *node)
 {
-	int res;
-	/* change path to specific mirror directory instead of root */
-	char ffrom[PATH_MAX];
-	char fto[PATH_MAX];
-	xmp_fullpath(ffrom, from);
-	xmp_fullpath(fto, to);
-	res = rename(ffrom, fto);
-	if (res == -1)
-		return -errno;
+	const struct xmp_file *fh = node->dirty;
 
-	return 0;
+	if (fh != NULL && fh->wb_off + (off_t) fh->wb_len > node->size)
+		return fh->wb_off + fh->wb_len;
+	return node->size;
 }
 
-static int xmp_link(const char *from, const char *to)
+/* Turn a new, empty backing file into an encrypted file of size 0.
+*	Called with node->lock held exclusive.
+*/
+static int xmp_inode_create(struct xmp_inode *node, int fd)
 {
 	int res;
-	char ffrom[PATH_MAX];
-	char fto[PATH_MAX];
-	xmp_fullpath(ffrom, from);
-	xmp_fullpath(fto, to);
-	res = link(ffrom, fto);
-	if (res == -1)
-		return -errno;
 
-	return 0;
+	cf_init_header(&node->hdr, CF_DEFAULT_CHUNK, XMP_DATA->cipher);
+	node->chunked = 1;
+	node->size = 0;
+	node->loaded = 1;
+	ac_forget(XMP_DATA->attrs, node->dev, node->ino);
+
+	res = cf_write_header(fd, &node->hdr);
+	if (res < 0) {
+		log_error("create: writing header failed: %s", strerror(-res));
+		return res;
+	}
+
+	if (fsetxattr(fd, XATRR_ENCRYPTED_FLAG, ENCRYPTED, 4, 0)) {
+		res = -errno;
+		log_error("create: setting encrypted xattr failed: %s", strerror(-res));
+		return res;
+	}
+
+	res = xmp_set_size(fd, 0);
+	if (res)
+		log_error("create: setting size xattr failed: %s", strerror(-res));
+
+	return res;
 }
 
-static int xmp_chmod(const char *path, mode_t mode)
+/* Read the header and size of an encrypted file on its first open, and convert a
+*	legacy file the first time it is opened for writing.
+*	Called with node->lock held exclusive.
+*/
+static int xmp_inode_load(struct xmp_inode *node, int fd, const struct aes_key *key, int writable)
 {
 	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = chmod(fpath, mode);
-	if (res == -1)
-		return -errno;
 
-	return 0;
+	struct stat st;
+
+	if (node->loaded && (node->chunked || !writable))
+		return 0;
+
+	/* Cached chunks are keyed by device and inode number and outlive the last close.
+	*	Drop them if the file changed since then, or the node is new and the
+	*	number may have belonged to a file replaced in the mirror.
+	*/
+	if (!node->loaded && XMP_DATA->cache) {
+		if (!node->chunks_valid || fstat(fd, &st) == -1 ||
+		    st.st_ctim.tv_sec != node->chunks_ctime.tv_sec ||
+		    st.st_ctim.tv_nsec != node->chunks_ctime.tv_nsec)
+			bc_invalidate(XMP_DATA->cache, node->dev, node->ino, 0, -1);
+		node->chunks_valid = 0;
+	}
+
+	node->loaded = 0;
+	res = cf_read_header(fd, &node->hdr);
+	if (res == 0 && writable) {
+		res = xmp_migrate_legacy(fd, key);
+		ac_forget(XMP_DATA->attrs, node->dev, node->ino);
+		if (res == 0)
+			res = cf_read_header(fd, &node->hdr);
+	}
+	if (res < 0)
+		return res;
+	node->chunked = res;
+
+	res = xmp_fget_size(fd, &node->size);
+	if (res < 0)
+		res = xmp_recover_size(node, fd, &node->size);
+	if (res == 0)
+		node->loaded = 1;
+
+	return res;
 }
 
-static int xmp_chown(const char *path, uid_t uid, gid_t gid)
+/* Replace the size lstat reported for a regular file with its plaintext size.
+*	Open encrypted files answer from their node; others from the attribute cache
+*	or, on a miss, one getxattr each for the flag and the size.
+*/
+static int xmp_inode_size(struct xmp_inode *node, struct stat *stbuf)
 {
 	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = lchown(fpath, uid, gid);
-	if (res == -1)
-		return -errno;
+	int encrypted;
+	off_t size;
+	unsigned long gen;
+	char procpath[XMP_PROC_PATH];
+
+	if (!S_ISREG(stbuf->st_mode))
+		return 0;
+
+	pthread_rwlock_rdlock(&node->lock);
+	encrypted = node->loaded;
+	if (encrypted)
+		stbuf->st_size = xmp_inode_end(node);
+	pthread_rwlock_unlock(&node->lock);
+	if (encrypted)
+		return 0;
+
+	/* Unchanged since the last getattr: no xattr calls at all */
+	if (ac_lookup(XMP_DATA->attrs, stbuf, &encrypted, &size, &gen)) {
+		if (encrypted)
+			stbuf->st_size = size;
+		return 0;
+	}
+
+	/* is it a regular encrypted file? */
+	xmp_proc_path(procpath, node);
+	encrypted = xmp_is_encrypted(procpath);
+	size = -1;
+	if (encrypted){
+		res = xmp_get_size(procpath, &size);
+		if (res < 0) {
+			int fd = open(procpath, O_RDONLY);
+			if (fd == -1)
+				return -errno;
+			res = xmp_recover_size(node, fd, &size);
+			close(fd);
+		}
+		if (res < 0)
+			return res;
+
+		stbuf->st_size = size;
+	}
+	ac_store(XMP_DATA->attrs, stbuf, encrypted, size, gen);
 
 	return 0;
 }
 
-static int xmp_truncate(const char *path, off_t size)
+/* This function gets certain characteristics of a file like size and stores them in a struct called stat.
+*	For encrypted files the size is the plaintext size kept in the XATRR_PLAIN_SIZE attribute, so this is
+*	one fstatat plus one getxattr no matter how large the file is.
+*/
+static int xmp_inode_stat(struct xmp_inode *node, struct stat *stbuf)
 {
-	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = truncate(fpath, size);
-	if (res == -1)
+	if (fstatat(node->fd, "", stbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1)
 		return -errno;
 
-	return 0;
+	return xmp_inode_size(node, stbuf);
 }
 
-static int xmp_utimens(const char *path, const struct timespec ts[2])
+/* Resolve name in parent to a node, counting one kernel lookup of it, and fill in
+*	the entry the kernel gets back
+*/
+static int xmp_lookup_entry(fuse_ino_t parent, const char *name, struct fuse_entry_param *e)
 {
 	int res;
-	struct timeval tv[2];
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	tv[0].tv_sec = ts[0].tv_sec;
-	tv[0].tv_usec = ts[0].tv_nsec / 1000;
-	tv[1].tv_sec = ts[1].tv_sec;
-	tv[1].tv_usec = ts[1].tv_nsec / 1000;
+	int fd;
+	struct xmp_inode *node;
 
-	res = utimes(fpath, tv);
-	if (res == -1)
+	memset(e, 0, sizeof(*e));
+	e->attr_timeout = XMP_DATA->attr_timeout;
+	e->entry_timeout = XMP_DATA->entry_timeout;
+
+	fd = openat(xmp_inode(parent)->fd, name, O_PATH | O_NOFOLLOW);
+	if (fd == -1)
 		return -errno;
+	if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+		res = -errno;
+		close(fd);
+		return res;
+	}
+
+	node = xmp_inode_get(&e->attr, fd);
+	if (node == NULL) {
+		close(fd);
+		return -ENOMEM;
+	}
+	res = xmp_inode_size(node, &e->attr);
+	if (res < 0) {
+		xmp_inode_unref(node, 1);
+		return res;
+	}
 
+	e->ino = (uintptr_t) node;
 	return 0;
 }
 
-static int xmp_open(const char *path, struct fuse_file_info *fi)
+/* Reply to an operation that made or found parent/name with its entry */
+static void xmp_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
 	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = open(fpath, fi->flags);
-	if (res == -1)
-		return -errno;
+	struct fuse_entry_param e;
 
-	close(res);
-	return 0;
+	res = xmp_lookup_entry(parent, name, &e);
+	if (res < 0) {
+		xmp_reply_err(req, -res);
+		return;
+	}
+	/* An interrupted request never reaches the kernel, so neither does the lookup */
+	if (fuse_reply_entry(req, &e) != 0)
+		xmp_inode_unref(xmp_inode(e.ino), 1);
 }
 
-/* This function reads file contents into application window */
-static int xmp_read(const char *path, char *buf, size_t size, off_t offset,
-		    struct fuse_file_info *fi)
+/* Open flags for the backing file of an encrypted file.
+*	Encrypted files are always opened read/write when written to, since partial
+*	chunks have to be read back, and offsets are plaintext offsets laid out by us.
+*/
+static int xmp_crypt_flags(int flags)
 {
+	flags &= ~O_APPEND;
+	if (!(flags & O_CREAT))
+		flags &= ~O_TRUNC;
+	if ((flags & O_ACCMODE) == O_WRONLY)
+		flags = (flags & ~O_ACCMODE) | O_RDWR;
 
-	(void)fi;
-	int res;
-	int crypt_action = PASS_THROUGH;
-	ssize_t valsize = 0;
-	char *tmpval = NULL;
+	return flags;
+}
 
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
+/* Encrypt plaintext straight to a chunked or legacy file.
+*	Only the chunks covering offset,size are re-encrypted.
+*	Called with node->lock held exclusive.
+*/
+static int xmp_write_through(struct xmp_file *fh, const char *buf, size_t size, off_t offset)
+{
+	int res;
+	off_t old_size;
+	struct xmp_inode *node = fh->node;
 
-	valsize = getxattr(fpath, XATRR_ENCRYPTED_FLAG, NULL, 0);
-	tmpval = malloc(sizeof(*tmpval)*(valsize));
-	valsize = getxattr(fpath, XATRR_ENCRYPTED_FLAG, tmpval, valsize);
-		
-	fprintf(stderr, " Read: Xattr Value: %s\n", tmpval);
+	old_size = node->size;
+	res = cf_pwrite(fh->fd, &node->hdr, fh->key, buf, size, offset, &node->size);
 
-	/* If the specified attribute doesn't exist or it's set to false */
-	if (valsize < 0 || memcmp(tmpval, "false", 5) == 0){
-		if(errno == ENOATTR){
-			fprintf(stderr, "Read: No %s attribute set\n", XATRR_ENCRYPTED_FLAG);
-		}
-		fprintf(stderr, "Read: file is unencrypted, leaving crypt_action as pass-through\n");
-	}/* If the attribute exists and is true then we need to get size of decrypted file */
-	else if (memcmp(tmpval, "true", 4) == 0){
-		fprintf(stderr, "Read: file is encrypted, need to decrypt\n");
-		crypt_action = DECRYPT;
+	/* Padding the old last chunk or filling a gap keeps their plaintext, so only
+	*	the chunks covering the write go stale
+	*/
+	if (XMP_DATA->cache && size > 0)
+		bc_invalidate(XMP_DATA->cache, node->dev, node->ino, offset / node->hdr.chunk_size,
+			      (offset + size - 1) / node->hdr.chunk_size);
+
+	/* Keep the recorded plaintext size current for getattr */
+	if (res >= 0 && node->size != old_size) {
+		int err = xmp_set_size(fh->fd, node->size);
+		if (err < 0)
+			res = err;
+		ac_forget(XMP_DATA->attrs, node->dev, node->ino);
 	}
 
-	const char *tmpPath = tmp_path(fpath, SUFFIXREAD);
-	FILE *tmpFile = fopen(tmpPath, "wb+");
-	FILE *f = fopen(fpath, "rb");
-
-	fprintf(stderr, "Read: fpath: %s\ntmpPath: %s\n", fpath, tmpPath);
+	return res;
+}
 
-	if(!do_crypt(f, tmpFile, crypt_action, XMP_DATA->key_phrase)){
-	fprintf(stderr, "Read: do_crypt failed\n");
-    }
+/* Encrypt a handle's buffered run to disk and empty the buffer. The data is
+*	gone from memory whether or not that worked.
+*	Called with node->lock held exclusive.
+*/
+static int xmp_wb_flush(struct xmp_file *fh)
+{
+	int res;
+	struct xmp_state *st = XMP_DATA;
 
-    fseek(tmpFile, 0, SEEK_END);
-    size_t tmpFilelen = ftell(tmpFile);
-    fseek(tmpFile, 0, SEEK_SET);
+	if (fh->wb_len == 0)
+		return 0;
 
-    fprintf(stderr, "Read: size given by read: %zu\nsize of tmpFile: %zu\nsize of offset: %zu\n", size, tmpFilelen, offset);
+	log_debug("writeback %zu bytes at %lld", fh->wb_len, (long long) fh->wb_off);
+	res = xmp_write_through(fh, fh->wb, fh->wb_len, fh->wb_off);
+	if (res > 0)
+		res = 0;
 
-    /* Read the decrypted contents of original file to the application widow */
-    res = fread(buf, 1, tmpFilelen, tmpFile);
-    if (res == -1)
-    	res = -errno;
+	pthread_mutex_lock(&st->wb_lock);
+	st->wb_bytes -= fh->wb_len;
+	if (fh->wb_prev)
+		fh->wb_prev->wb_next = fh->wb_next;
+	else
+		st->wb_head = fh->wb_next;
+	if (fh->wb_next)
+		fh->wb_next->wb_prev = fh->wb_prev;
+	else
+		st->wb_tail = fh->wb_prev;
+	fh->wb_prev = fh->wb_next = NULL;
+	pthread_mutex_unlock(&st->wb_lock);
 
-	fclose(f);
-	fclose(tmpFile);
-	remove(tmpPath);
-	free(tmpval);
+	free(fh->wb);
+	fh->wb = NULL;
+	fh->wb_len = fh->wb_cap = 0;
+	fh->node->dirty = NULL;
 
 	return res;
-	
-	
 }
 
-/* Write contents to encrypted or unencrypted file
-*	Echo was used to write to files.  See bottom of README, IMPORTANT NOTES.
+/* Write out a buffer on behalf of someone other than its handle; a failure is
+*	kept for the handle's next flush or fsync to report
 */
-static int xmp_write(const char *path, const char *buf, size_t size,
-		     off_t offset, struct fuse_file_info *fi)
+static void xmp_wb_flush_error(struct xmp_file *fh)
 {
-	(void) fi;
-	(void) offset;
-	int res;
-	int fd;
-	int crypt_action = PASS_THROUGH;
-	ssize_t valsize = 0;
-	char *tmpval = NULL;
-
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-
-
-	valsize = getxattr(fpath, XATRR_ENCRYPTED_FLAG, NULL, 0);
-	tmpval = malloc(sizeof(*tmpval)*(valsize));
-	valsize = getxattr(fpath, XATRR_ENCRYPTED_FLAG, tmpval, valsize);
-		
-	fprintf(stderr, " WRITE: Xattr Value: %s\n", tmpval);
+	int res = xmp_wb_flush(fh);
 
-	if (valsize < 0 || memcmp(tmpval, "false", 5) == 0){
-		if(errno == ENOATTR){
-			fprintf(stderr, "WRITE: No %s attribute set\n", XATRR_ENCRYPTED_FLAG);
-		}
-		fprintf(stderr, "WRITE: file is unencrypted, leaving crypt_action as pass-through\n");
-	}/* If the attribute exists and is true then we need to get size of decrypted file */
-	else if (memcmp(tmpval, "true", 4) == 0){
-		fprintf(stderr, "WRITE: file is encrypted, need to decrypt\n");
-		crypt_action = DECRYPT;
+	if (res < 0) {
+		log_error("writeback of inode %llu failed: %s", (unsigned long long) fh->node->ino,
+			  strerror(-res));
+		fh->wb_err = res;
 	}
+}
 
-	fprintf(stderr, "crypt_action is set to %d\n", crypt_action);
-
-	/* If the file to be written to is encrypted */
-	if (crypt_action == DECRYPT){
-		fprintf(stderr, "WRITE: File to be written is encrypted\n");
-		
-		FILE *f = fopen(fpath, "rb+");
-		const char *tmpPath = tmp_path(fpath, SUFFIXWRITE);
-		FILE *tmpFile = fopen(tmpPath, "wb+");
+/* Merge a write into the handle's buffered run, which it continues or overlaps.
+*	Called with node->lock held exclusive.
+*/
+static int xmp_wb_add(struct xmp_file *fh, const char *buf, size_t size, off_t offset)
+{
+	struct xmp_state *st = XMP_DATA;
+	off_t start = offset;
+	off_t end = offset + (off_t) size;
+	size_t len;
+	size_t grown;
+	char *wb;
+
+	if (fh->wb_len > 0) {
+		if (fh->wb_off < start)
+			start = fh->wb_off;
+		if (fh->wb_off + (off_t) fh->wb_len > end)
+			end = fh->wb_off + fh->wb_len;
+	}
+	len = end - start;
+
+	if (len > fh->wb_cap) {
+		wb = realloc(fh->wb, len > 2 * fh->wb_cap ? len : 2 * fh->wb_cap);
+		if (wb == NULL)
+			return -ENOMEM;
+		fh->wb = wb;
+		fh->wb_cap = len > 2 * fh->wb_cap ? len : 2 * fh->wb_cap;
+	}
+	/* The write starts before the run: move the run up */
+	if (fh->wb_len > 0 && start < fh->wb_off)
+		memmove(fh->wb + (fh->wb_off - start), fh->wb, fh->wb_len);
+	memcpy(fh->wb + (offset - start), buf, size);
+	grown = len - fh->wb_len;
+
+	pthread_mutex_lock(&st->wb_lock);
+	if (fh->wb_len == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &fh->wb_since);
+		fh->wb_prev = st->wb_tail;
+		if (st->wb_tail)
+			st->wb_tail->wb_next = fh;
+		else
+			st->wb_head = fh;
+		st->wb_tail = fh;
+		pthread_cond_signal(&st->wb_cond);
+	}
+	st->wb_bytes += grown;
+	pthread_mutex_unlock(&st->wb_lock);
 
-		fprintf(stderr, "path of original file %s\n", fpath);
+	fh->wb_off = start;
+	fh->wb_len = len;
+	fh->node->dirty = fh;
 
-		fseek(f, 0, SEEK_END);
-		size_t original = ftell(f);
-		fseek(f, 0, SEEK_SET);
-		fprintf(stderr, "Size of original file %zu\n", original);
+	return size;
+}
 
-		fprintf(stderr, "Decrypting contents of original file to tmpFile for writing\n");
-		if(!do_crypt(f, tmpFile, DECRYPT, XMP_DATA->key_phrase)){
-		fprintf(stderr, "WRITE: do_crypt failed\n");
-    	}
+/* Write out a handle's buffer and collect any error an earlier write-out hit,
+*	for flush and fsync
+*/
+static int xmp_file_writeback(struct xmp_file *fh)
+{
+	int res;
 
-    	fseek(f, 0, SEEK_SET);
+	if (!fh->encrypted || !fh->writable)
+		return 0;
 
-    	size_t tmpFilelen = ftell(tmpFile);
-    	fprintf(stderr, "Size to be written to tmpFile %zu\n", size);
-    	fprintf(stderr, "size of tmpFile %zu\n", tmpFilelen);
-    	fprintf(stderr, "Writing to tmpFile\n");
+	pthread_rwlock_wrlock(&fh->node->lock);
+	res = xmp_wb_flush(fh);
+	if (res == 0)
+		res = fh->wb_err;
+	fh->wb_err = 0;
+	pthread_rwlock_unlock(&fh->node->lock);
 
-    	res = fwrite(buf, 1, size, tmpFile);
-    	if (res == -1)
-			res = -errno;
+	return res;
+}
 
-		tmpFilelen = ftell(tmpFile);
-		fprintf(stderr, "Size of tmpFile after write %zu\n", tmpFilelen);
+static void xmp_ts_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
 
-		fseek(tmpFile, 0, SEEK_SET);
+/* Timer thread: write out buffers that have been dirty for wb_delay_ms.
+*	A request may hold the file's lock while waiting for wb_lock, so the timer
+*	only tries the file lock and comes back later if it is busy. Holding the file
+*	lock keeps the handle from being released under it.
+*/
+static void *xmp_wb_timer(void *arg)
+{
+	struct xmp_state *st = arg;
+	struct xmp_file *fh;
+	struct xmp_inode *node;
+	struct timespec now;
+	struct timespec due;
+
+	pthread_mutex_lock(&st->wb_lock);
+	while (!st->wb_stop) {
+		fh = st->wb_head;
+		if (fh == NULL) {
+			pthread_cond_wait(&st->wb_cond, &st->wb_lock);
+			continue;
+		}
 
-		fprintf(stderr, "Encrypting new contents of tmpFile into original file\n");
-		if(!do_crypt(tmpFile, f, ENCRYPT, XMP_DATA->key_phrase)){
-		fprintf(stderr, "WRITE: do_crypt failed\n");
+		due = fh->wb_since;
+		xmp_ts_add_ms(&due, st->wb_delay_ms);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec < due.tv_sec || (now.tv_sec == due.tv_sec && now.tv_nsec < due.tv_nsec)) {
+			pthread_cond_timedwait(&st->wb_cond, &st->wb_lock, &due);
+			continue;
 		}
 
-		fclose(f);
-		fclose(tmpFile);
-		remove(tmpPath);
-    	
-	}/* If the file to be written to is unencrypted */
-	else if (crypt_action == PASS_THROUGH){
-		fprintf(stderr, "File to be written is unencrypted");
+		node = fh->node;
+		if (pthread_rwlock_trywrlock(&node->lock) != 0) {
+			due = now;
+			xmp_ts_add_ms(&due, 10);
+			pthread_cond_timedwait(&st->wb_cond, &st->wb_lock, &due);
+			continue;
+		}
+		pthread_mutex_unlock(&st->wb_lock);
 
-		fd = open(fpath, O_WRONLY);
-		if (fd == -1)
-			return -errno;
+		xmp_wb_flush_error(fh);
+		pthread_rwlock_unlock(&node->lock);
 
-		res = pwrite(fd, buf, size, offset);
-		if (res == -1)
-			res = -errno;
+		pthread_mutex_lock(&st->wb_lock);
+	}
+	pthread_mutex_unlock(&st->wb_lock);
 
-		close(fd);
-   	}
-   	
-	free(tmpval);
-	return res;
+	return NULL;
 }
 
-static int xmp_statfs(const char *path, struct statvfs *stbuf)
+/* Fill in a handle for a backing file already opened with flags.
+*	Legacy files are converted before they are written. With O_CREAT the file is
+*	set up as a new, empty encrypted file. The caller keeps fd on failure.
+*/
+static int xmp_file_init(struct xmp_inode *node, int fd, int flags, int encrypted,
+			 struct xmp_file **fhp)
 {
 	int res;
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	res = statvfs(fpath, stbuf);
-	if (res == -1)
-		return -errno;
+	struct xmp_file *fh;
+
+	fh = calloc(1, sizeof(*fh));
+	if (fh == NULL)
+		return -ENOMEM;
+
+	fh->fd = fd;
+	fh->encrypted = encrypted;
+	fh->writable = (flags & O_ACCMODE) != O_RDONLY;
+	fh->node = node;
+	fh->key = &XMP_DATA->key;
+
+	if (!fh->encrypted) {
+		*fhp = fh;
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&node->lock);
+	if (flags & O_CREAT) {
+		/* Writes another handle buffered came before O_TRUNC emptied the file */
+		if (node->dirty != NULL) {
+			xmp_wb_flush_error(node->dirty);
+			if (ftruncate(fd, 0) == -1)
+				log_warn("create: truncating inode %llu again failed: %s",
+					 (unsigned long long) node->ino, strerror(errno));
+		}
+		res = xmp_inode_create(node, fd);
+		/* O_TRUNC may have emptied an existing file */
+		if (XMP_DATA->cache)
+			bc_invalidate(XMP_DATA->cache, node->dev, node->ino, 0, -1);
+	}
+	else {
+		res = xmp_inode_load(node, fd, fh->key, (flags & O_ACCMODE) != O_RDONLY);
+	}
+	if (res == 0)
+		node->opens++;
+	pthread_rwlock_unlock(&node->lock);
+	if (res < 0) {
+		free(fh);
+		return res;
+	}
 
+	*fhp = fh;
 	return 0;
 }
 
-/* Create a file with encrypted contents and encrypted flag
-* An empty file is encrypted so that you can't tell if it is empty or not
+/* Encrypted flag of a node's backing file.
+*	An fstatat on the node is enough when the attribute cache knows the file;
+*	only a miss reads the xattr through the /proc path.
 */
+static int xmp_inode_encrypted(struct xmp_inode *node, const char *procpath)
+{
+	struct stat st;
+	int encrypted;
+	off_t size;
+	unsigned long gen;
 
-static int xmp_create(const char* path, mode_t mode, struct fuse_file_info* fi) {
-
-	
-    char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	
+	if (S_ISREG(node->type) &&
+	    fstatat(node->fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == 0 &&
+	    ac_lookup(XMP_DATA->attrs, &st, &encrypted, &size, &gen))
+		return encrypted;
 
-    (void) fi;
-    (void) mode;
+	return xmp_is_encrypted(procpath);
+}
 
-	FILE *f = fopen(fpath, "wb+");
+/* Open the backing file of a node and fill in a handle for it */
+static int xmp_file_open(struct xmp_inode *node, int flags, struct xmp_file **fhp)
+{
+	int res;
+	int fd;
+	int encrypted;
+	char procpath[XMP_PROC_PATH];
 
-	fprintf(stderr, "CREATE: fpath: %s\n", fpath);
+	xmp_proc_path(procpath, node);
+	encrypted = xmp_inode_encrypted(node, procpath);
+	if (encrypted)
+		flags = xmp_crypt_flags(flags);
 
-	/* It is okay to encrypt a file into itself as long as it's empty
-	*	otherwise the contents of the file would be erased.
-	*/
+	fd = open(procpath, flags & ~O_NOFOLLOW);
+	if (fd == -1)
+		return -errno;
 
-	if(!do_crypt(f, f, ENCRYPT, XMP_DATA->key_phrase)){
-		fprintf(stderr, "Create: do_crypt failed\n");
-    	}
+	res = xmp_file_init(node, fd, flags, encrypted, fhp);
+	if (res < 0)
+		close(fd);
 
-	fprintf(stderr, "Create: encryption done correctly\n");
+	return res;
+}
 
-	fclose(f);
+/* Note a read of a chunked file and, once reads have followed each other for
+*	XMP_RA_MIN_SEQ reads, queue the next ra_chunks chunks for the readahead thread.
+*	The window is topped up when the reader is half way through it, so the thread
+*	stays ahead without being asked for every read.
+*/
+static void xmp_readahead(struct xmp_file *fh, off_t offset, size_t size, size_t chunk_size)
+{
+	struct xmp_state *st = XMP_DATA;
+	off_t cur;
 
-	if(setxattr(fpath, XATRR_ENCRYPTED_FLAG, ENCRYPTED, 4, 0)){
-    	fprintf(stderr, "error setting xattr of file %s\n", fpath);
-    	return -errno;
-   	}
-   	fprintf(stderr, "Create: file xatrr correctly set %s\n", fpath);
-    
+	if (!st->ra_running || size == 0)
+		return;
 
-    return 0;
+	pthread_mutex_lock(&st->ra_lock);
+	if (offset == fh->ra_next) {
+		fh->ra_seq++;
+	}
+	else {
+		fh->ra_seq = 0;
+		fh->ra_end = 0;
+	}
+	fh->ra_next = offset + size;
+
+	cur = (offset + size - 1) / chunk_size;
+	if (fh->ra_seq >= XMP_RA_MIN_SEQ && fh->ra_end - cur <= st->ra_chunks / 2) {
+		if (!fh->ra_queued) {
+			fh->ra_first = fh->ra_end > cur ? fh->ra_end : cur + 1;
+			fh->ra_queued = 1;
+			fh->ra_qnext = NULL;
+			if (st->ra_tail)
+				st->ra_tail->ra_qnext = fh;
+			else
+				st->ra_head = fh;
+			st->ra_tail = fh;
+			pthread_cond_broadcast(&st->ra_cond);
+		}
+		fh->ra_last = cur + st->ra_chunks;
+		fh->ra_end = fh->ra_last + 1;
+	}
+	pthread_mutex_unlock(&st->ra_lock);
 }
 
-
-static int xmp_release(const char *path, struct fuse_file_info *fi)
+/* Decrypt the chunks first..last of a handle's file that are not cached yet
+*	into the chunk cache, XMP_RA_BATCH at a time. The file lock is held shared per
+*	batch, as for a read, so writers are not held up for the whole window.
+*/
+static void xmp_prefetch(struct xmp_file *fh, off_t first, off_t last)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	struct xmp_inode *node = fh->node;
+	struct block_cache *bc = XMP_DATA->cache;
+	size_t cs;
+	unsigned char *plain;
+	ssize_t got;
+	off_t idx;
+	off_t next;
+	off_t end;
+	int cancel;
+
+	pthread_rwlock_rdlock(&node->lock);
+	cs = node->hdr.chunk_size;
+	pthread_rwlock_unlock(&node->lock);
+	plain = malloc(XMP_RA_BATCH * cs);
+	if (plain == NULL)
+		return;
+
+	for (idx = first; idx <= last; idx = next) {
+		pthread_mutex_lock(&XMP_DATA->ra_lock);
+		cancel = fh->ra_cancel;
+		pthread_mutex_unlock(&XMP_DATA->ra_lock);
+		if (cancel)
+			break;
 
-	(void) path;
-	(void) fi;
-	return 0;
+		pthread_rwlock_rdlock(&node->lock);
+		end = (node->size + cs - 1) / cs;
+		if (last >= end)
+			last = end - 1;
+		while (idx <= last && bc_contains(bc, node->dev, node->ino, idx))
+			idx++;
+		next = idx;
+		while (next <= last && next - idx < XMP_RA_BATCH &&
+		       !bc_contains(bc, node->dev, node->ino, next))
+			next++;
+
+		if (next > idx) {
+			got = cf_pread(fh->fd, &node->hdr, fh->key, (char *) plain, (next - idx) * cs,
+				       idx * (off_t) cs, node->size);
+			if (got < 0) {
+				pthread_rwlock_unlock(&node->lock);
+				log_debug("readahead of inode %llu failed: %s",
+					  (unsigned long long) node->ino, strerror(-got));
+				break;
+			}
+			/* Past the end of file a chunk reads as zeros, as in xmp_fill_chunks */
+			memset(plain + got, 0, (next - idx) * cs - got);
+			for (end = idx; end < next; end++)
+				bc_put(bc, node->dev, node->ino, end, plain + (end - idx) * cs, cs);
+		}
+		pthread_rwlock_unlock(&node->lock);
+	}
+
+	free(plain);
 }
 
-static int xmp_fsync(const char *path, int isdatasync,
-		     struct fuse_file_info *fi)
+/* Readahead thread: works through the queued handles in order */
+static void *xmp_ra_thread(void *arg)
 {
-	/* Just a stub.	 This method is optional and can safely be left
-	   unimplemented */
+	struct xmp_state *st = arg;
+	struct xmp_file *fh;
+	off_t first;
+	off_t last;
+
+	pthread_mutex_lock(&st->ra_lock);
+	while (!st->ra_stop) {
+		fh = st->ra_head;
+		if (fh == NULL) {
+			pthread_cond_wait(&st->ra_cond, &st->ra_lock);
+			continue;
+		}
+		st->ra_head = fh->ra_qnext;
+		if (st->ra_head == NULL)
+			st->ra_tail = NULL;
+		fh->ra_queued = 0;
+		first = fh->ra_first;
+		last = fh->ra_last;
+		st->ra_active = fh;
+		pthread_mutex_unlock(&st->ra_lock);
+
+		xmp_prefetch(fh, first, last);
+
+		pthread_mutex_lock(&st->ra_lock);
+		st->ra_active = NULL;
+		pthread_cond_broadcast(&st->ra_cond);
+	}
+	pthread_mutex_unlock(&st->ra_lock);
 
-	(void) path;
-	(void) isdatasync;
-	(void) fi;
-	return 0;
+	return NULL;
 }
 
-#ifdef HAVE_SETXATTR
-static int xmp_setxattr(const char *path, const char *name, const char *value,
-			size_t size, int flags)
+/* Take a handle that is going away off the readahead queue and wait for the
+*	thread to be done with it
+*/
+static void xmp_ra_cancel(struct xmp_file *fh)
 {
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	int res = lsetxattr(fpath, name, value, size, flags);
-	if (res == -1)
-		return -errno;
-	return 0;
+	struct xmp_state *st = XMP_DATA;
+	struct xmp_file **pp;
+	struct xmp_file *prev = NULL;
+
+	if (!st->ra_running)
+		return;
+
+	pthread_mutex_lock(&st->ra_lock);
+	if (fh->ra_queued) {
+		for (pp = &st->ra_head; *pp != fh; pp = &(*pp)->ra_qnext)
+			prev = *pp;
+		*pp = fh->ra_qnext;
+		if (st->ra_tail == fh)
+			st->ra_tail = prev;
+		fh->ra_queued = 0;
+	}
+	fh->ra_cancel = 1;
+	while (st->ra_active == fh)
+		pthread_cond_wait(&st->ra_cond, &st->ra_lock);
+	pthread_mutex_unlock(&st->ra_lock);
 }
 
-static int xmp_getxattr(const char *path, const char *name, char *value,
-			size_t size)
+/* Close a handle, writing out what it buffered. The node of an encrypted file
+*	forgets its header and size with the last one, so the next open sees changes
+*	made behind our back, and notes the file's ctime so that open can tell
+*	whether the cached chunks still match (see xmp_inode_load).
+*/
+static void xmp_file_close(struct xmp_file *fh)
 {
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	int res = lgetxattr(fpath, name, value, size);
-	if (res == -1)
-		return -errno;
+	struct stat st;
+	struct xmp_inode *node = fh->node;
+
+	if (fh->encrypted)
+		xmp_ra_cancel(fh);
+
+	/* Nobody is left to report a write-out failure to */
+	if (fh->encrypted) {
+		pthread_rwlock_wrlock(&node->lock);
+		xmp_wb_flush_error(fh);
+		if (--node->opens == 0) {
+			node->loaded = 0;
+			node->chunks_valid = 0;
+			if (fstat(fh->fd, &st) == 0) {
+				node->chunks_valid = 1;
+				node->chunks_ctime = st.st_ctim;
+			}
+		}
+		pthread_rwlock_unlock(&node->lock);
+	}
+
+	/* What the kernel cached matches the file as it is now, see xmp_keep_cache */
+	if (XMP_DATA->auto_cache && fstat(fh->fd, &st) == 0) {
+		pthread_rwlock_wrlock(&node->lock);
+		node->cached = 1;
+		node->cached_mtime = st.st_mtim;
+		node->cached_ctime = st.st_ctim;
+		node->cached_size = st.st_size;
+		pthread_rwlock_unlock(&node->lock);
+	}
+
+	close(fh->fd);
+	free(fh);
+}
+
+/* Change the plaintext size through an open handle.
+*	Truncating the ciphertext would cut a chunk, so encrypted files only rewrite the
+*	chunk holding the new end and cut the slots after it.
+*/
+static int xmp_file_truncate(struct xmp_file *fh, off_t size)
+{
+	int res;
+	off_t old_size;
+	struct xmp_inode *node = fh->node;
+
+	if (!fh->encrypted) {
+		if (ftruncate(fh->fd, size) == -1)
+			return -errno;
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&node->lock);
+	/* Buffered writes land first, then get cut like the rest */
+	if (node->dirty != NULL)
+		xmp_wb_flush_error(node->dirty);
+	old_size = node->size;
+	res = cf_truncate(fh->fd, &node->hdr, fh->key, &node->size, size);
+
+	/* Chunks from the smaller end on changed, the one holding it included */
+	if (XMP_DATA->cache)
+		bc_invalidate(XMP_DATA->cache, node->dev, node->ino,
+			      (size < old_size ? size : old_size) / node->hdr.chunk_size, -1);
+	if (res == 0)
+		res = xmp_set_size(fh->fd, node->size);
+	ac_forget(XMP_DATA->attrs, node->dev, node->ino);
+	pthread_rwlock_unlock(&node->lock);
+
 	return res;
 }
 
-static int xmp_listxattr(const char *path, char *list, size_t size)
+/* Drop the cached chunks of a file that is about to be removed, so a new file
+*	that gets the same inode number never sees them
+*/
+static void xmp_forget_cached(int dirfd, const char *name)
 {
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	int res = llistxattr(fpath, list, size);
-	if (res == -1)
-		return -errno;
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+		ac_forget(XMP_DATA->attrs, st.st_dev, st.st_ino);
+		if (XMP_DATA->cache)
+			bc_invalidate(XMP_DATA->cache, st.st_dev, st.st_ino, 0, -1);
+	}
+}
+
+/* Drop the cached encrypted flag and size of a file whose name changes */
+static void xmp_forget_attrs(int dirfd, const char *name)
+{
+	struct stat st;
+
+	if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+		ac_forget(XMP_DATA->attrs, st.st_dev, st.st_ino);
+}
+
+/* Serve a read from a legacy whole-file CBC file.
+*	Plaintext offsets equal ciphertext offsets in CBC, so only the blocks covering
+*	offset,size are read and decrypted.
+*/
+static int xmp_read_legacy(struct xmp_file *fh, char *buf, size_t size, off_t offset)
+{
+	off_t plain_size = fh->node->size;
+	ssize_t res;
+	off_t start;
+	off_t end;
+	unsigned char *blocks;
+
+	if (offset >= plain_size || size == 0)
+		return 0;
+	if ((off_t) size > plain_size - offset)
+		size = plain_size - offset;
+
+	start = offset & ~((off_t) AES_BLOCK_SIZE - 1);
+	end = (offset + size + AES_BLOCK_SIZE - 1) & ~((off_t) AES_BLOCK_SIZE - 1);
+
+	blocks = malloc(end - start);
+	if (blocks == NULL)
+		return -ENOMEM;
+
+	res = do_decrypt_fd(fh->fd, start, blocks, end - start, fh->key);
+	if (res >= 0 && res < offset + (off_t) size - start)
+		res = -EIO;
+	if (res >= 0) {
+		memcpy(buf, blocks + (offset - start), size);
+		res = size;
+	}
+
+	free(blocks);
 	return res;
 }
 
-static int xmp_removexattr(const char *path, const char *name)
+/* Copy the part of cached chunk idx that falls inside offset,size to buf */
+static int xmp_get_cached(struct xmp_file *fh, struct block_cache *bc, off_t idx,
+			  char *buf, size_t size, off_t offset)
 {
-	/* change path to specific mirror directory instead of root */
-	char fpath[PATH_MAX];
-	xmp_fullpath(fpath, path);
-	int res = lremovexattr(fpath, name);
-	if (res == -1)
-		return -errno;
+	off_t start = idx * (off_t) fh->node->hdr.chunk_size;
+	off_t end = start + (off_t) fh->node->hdr.chunk_size;
+	off_t lo = offset > start ? offset : start;
+	off_t hi = offset + (off_t) size < end ? offset + (off_t) size : end;
+
+	return bc_get(bc, fh->node->dev, fh->node->ino, idx, lo - start,
+		      (unsigned char *) buf + (lo - offset), hi - lo);
+}
+
+/* Decrypt chunks first..last of a chunked file, add them to the cache and copy the
+*	part of them that falls inside offset,size to buf
+*/
+static int xmp_fill_chunks(struct xmp_file *fh, struct block_cache *bc, off_t first, off_t last,
+			   char *buf, size_t size, off_t offset)
+{
+	size_t cs = fh->node->hdr.chunk_size;
+	size_t len = (last - first + 1) * cs;
+	unsigned char *plain;
+	ssize_t got;
+	off_t idx;
+
+	plain = malloc(len);
+	if (plain == NULL)
+		return -ENOMEM;
+
+	got = cf_pread(fh->fd, &fh->node->hdr, fh->key, (char *) plain, len, first * (off_t) cs, fh->node->size);
+	if (got < 0) {
+		free(plain);
+		return got;
+	}
+	/* Past the end of file a chunk reads as zeros, the same as its padding on disk */
+	memset(plain + got, 0, len - got);
+
+	for (idx = first; idx <= last; idx++) {
+		unsigned char *chunk = plain + (idx - first) * cs;
+		off_t start = idx * (off_t) cs;
+		off_t lo = offset > start ? offset : start;
+		off_t hi = offset + (off_t) size < start + (off_t) cs ? offset + (off_t) size : start + (off_t) cs;
+
+		bc_put(bc, fh->node->dev, fh->node->ino, idx, chunk, cs);
+		memcpy(buf + (lo - offset), chunk + (lo - start), hi - lo);
+	}
+
+	free(plain);
 	return 0;
 }
+
+/* Read a chunked file through the decrypted chunk cache.
+*	Cached chunks are copied out, each run of missing chunks is decrypted with one cf_pread.
+*/
+static int xmp_read_cached(struct xmp_file *fh, struct block_cache *bc, char *buf, size_t size,
+			   off_t offset)
+{
+	size_t cs = fh->node->hdr.chunk_size;
+	off_t first;
+	off_t last;
+	off_t idx;
+	off_t next;
+	int res;
+
+	if (offset >= fh->node->size || size == 0)
+		return 0;
+	if ((off_t) size > fh->node->size - offset)
+		size = fh->node->size - offset;
+
+	first = offset / cs;
+	last = (offset + size - 1) / cs;
+
+	for (idx = first; idx <= last; idx = next) {
+		next = idx + 1;
+		if (xmp_get_cached(fh, bc, idx, buf, size, offset))
+			continue;
+
+		/* Extend the miss up to the next cached chunk, which is copied out on the way */
+		while (next <= last && !xmp_get_cached(fh, bc, next, buf, size, offset))
+			next++;
+
+		res = xmp_fill_chunks(fh, bc, idx, next - 1, buf, size, offset);
+		if (res < 0)
+			return res;
+		if (next <= last)
+			next++;
+	}
+
+	return size;
+}
+
+/* Read what is on disk, then lay the buffered run of a dirty handle over it.
+*	Between the end on disk and the run the file reads as zeros, as the gap will
+*	once the run is written out. Called with node->lock held.
+*/
+static int xmp_read_dirty(struct xmp_file *fh, struct xmp_file *dirty, char *buf, size_t size,
+			  off_t offset)
+{
+	int res;
+	off_t end = xmp_inode_end(fh->node);
+	off_t lo;
+	off_t hi;
+
+	if (offset >= end || size == 0)
+		return 0;
+	if ((off_t) size > end - offset)
+		size = end - offset;
+
+	if (XMP_DATA->cache)
+		res = xmp_read_cached(fh, XMP_DATA->cache, buf, size, offset);
+	else
+		res = cf_pread(fh->fd, &fh->node->hdr, fh->key, buf, size, offset, fh->node->size);
+	if (res < 0)
+		return res;
+	memset(buf + res, 0, size - res);
+
+	lo = dirty->wb_off > offset ? dirty->wb_off : offset;
+	hi = dirty->wb_off + (off_t) dirty->wb_len;
+	if (hi > offset + (off_t) size)
+		hi = offset + size;
+	if (lo < hi)
+		memcpy(buf + (lo - offset), dirty->wb + (lo - dirty->wb_off), hi - lo);
+
+	return size;
+}
+
+/* Read plaintext from an encrypted file.
+*	Chunked encrypted files only decrypt the chunks covering offset,size.
+*/
+static int xmp_read_crypt(struct xmp_file *fh, char *buf, size_t size, off_t offset)
+{
+	int res;
+	struct xmp_file *dirty;
+
+	/* Readers share the lock, writers of the same file wait for them */
+	pthread_rwlock_rdlock(&fh->node->lock);
+	dirty = fh->node->dirty;
+	if (dirty != NULL)
+		res = xmp_read_dirty(fh, dirty, buf, size, offset);
+	else if (fh->node->chunked && XMP_DATA->cache)
+		res = xmp_read_cached(fh, XMP_DATA->cache, buf, size, offset);
+	else if (fh->node->chunked)
+		res = cf_pread(fh->fd, &fh->node->hdr, fh->key, buf, size, offset, fh->node->size);
+	else
+		res = xmp_read_legacy(fh, buf, size, offset);
+
+	/* Sequential readers find the chunks after this read decrypted already */
+	if (res > 0 && fh->node->chunked && XMP_DATA->cache)
+		xmp_readahead(fh, offset, res, fh->node->hdr.chunk_size);
+	pthread_rwlock_unlock(&fh->node->lock);
+
+	return res;
+}
+
+/* Write plaintext to an encrypted file.
+*	Echo was used to write to files.  See bottom of README, IMPORTANT NOTES.
+*	A write that continues or overlaps the handle's buffered run joins it; anything
+*	else, or a write as large as the buffer, writes the buffer out first. Writes
+*	to a file another handle has buffered data for write that data out first.
+*/
+static int xmp_write_crypt(struct xmp_file *fh, const char *buf, size_t size, off_t offset)
+{
+	int res = 0;
+	int over;
+	off_t start;
+	off_t end;
+	struct xmp_inode *node = fh->node;
+
+	pthread_rwlock_wrlock(&node->lock);
+	if (node->dirty != NULL && node->dirty != fh)
+		xmp_wb_flush_error(node->dirty);
+
+	end = fh->wb_off + (off_t) fh->wb_len;
+	if (fh->wb_len > 0 && (offset > end || offset + (off_t) size < fh->wb_off))
+		res = xmp_wb_flush(fh);
+
+	start = fh->wb_len > 0 && fh->wb_off < offset ? fh->wb_off : offset;
+	end = fh->wb_len > 0 && end > offset + (off_t) size ? end : offset + (off_t) size;
+	if (res == 0 && node->chunked && size > 0 && end - start < (off_t) XMP_DATA->wb_max) {
+		res = xmp_wb_add(fh, buf, size, offset);
+	}
+	else if (res == 0) {
+		res = fh->wb_len > 0 ? xmp_wb_flush(fh) : 0;
+		if (res == 0)
+			res = xmp_write_through(fh, buf, size, offset);
+	}
+
+	/* Over the total budget the writer pays for its own buffer right away */
+	if (res >= 0 && fh->wb_len > 0) {
+		pthread_mutex_lock(&XMP_DATA->wb_lock);
+		over = XMP_DATA->wb_bytes > (size_t) XMP_WB_TOTAL_MB << 20;
+		pthread_mutex_unlock(&XMP_DATA->wb_lock);
+		if (over) {
+			int err = xmp_wb_flush(fh);
+			if (err < 0)
+				res = err;
+		}
+	}
+	pthread_rwlock_unlock(&node->lock);
+
+	return res;
+}
+
+/* With -o negative_timeout a missing name is answered with inode 0, which the
+*	kernel caches as "does not exist" for that long instead of asking again
+*/
+static void xmp_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res;
+	struct fuse_entry_param e;
+
+	log_trace("lookup %llu/%s", (unsigned long long) parent, name);
+	__atomic_fetch_add(&xmp_inode(parent)->lookups, 1, __ATOMIC_RELAXED);
+	res = xmp_lookup_entry(parent, name, &e);
+	if (res == -ENOENT && XMP_DATA->negative_timeout > 0) {
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = XMP_DATA->negative_timeout;
+		fuse_reply_entry(req, &e);
+	}
+	else if (res < 0) {
+		xmp_reply_err(req, -res);
+	}
+	/* An interrupted request never reaches the kernel, so neither does the lookup */
+	else if (fuse_reply_entry(req, &e) != 0) {
+		xmp_inode_unref(xmp_inode(e.ino), 1);
+	}
+}
+
+static void xmp_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	xmp_inode_unref(xmp_inode(ino), nlookup);
+	fuse_reply_none(req);
+}
+
+static void xmp_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		xmp_inode_unref(xmp_inode(forgets[i].ino), forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void xmp_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int res;
+	struct stat st;
+
+	(void) fi;
+
+	log_trace("getattr %llu", (unsigned long long) ino);
+	res = xmp_inode_stat(xmp_inode(ino), &st);
+	if (res < 0)
+		xmp_reply_err(req, -res);
+	else
+		fuse_reply_attr(req, &st, XMP_DATA->attr_timeout);
+}
+
+/* chmod, chown, truncate and utimens in one call.
+*	With an open handle the size change goes through it, otherwise a handle is
+*	opened for the duration of the truncate.
+*/
+static void xmp_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			int valid, struct fuse_file_info *fi)
+{
+	int res = 0;
+	struct stat st;
+	struct xmp_file *fh;
+	struct xmp_inode *node = xmp_inode(ino);
+	char procpath[XMP_PROC_PATH];
+
+	xmp_proc_path(procpath, node);
+
+	if (valid & FUSE_SET_ATTR_MODE) {
+		if (fi != NULL)
+			res = fchmod(XMP_FILE(fi)->fd, attr->st_mode);
+		else
+			res = chmod(procpath, attr->st_mode);
+		if (res == -1)
+			goto out_errno;
+	}
+
+	if (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+		uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+		gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+		res = fchownat(node->fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+		if (res == -1)
+			goto out_errno;
+	}
+
+	if (valid & FUSE_SET_ATTR_SIZE) {
+		log_trace("truncate %llu to %lld", (unsigned long long) ino, (long long) attr->st_size);
+		if (fi != NULL) {
+			res = xmp_file_truncate(XMP_FILE(fi), attr->st_size);
+		} else {
+			res = xmp_file_open(node, O_WRONLY, &fh);
+			if (res == 0) {
+				res = xmp_file_truncate(fh, attr->st_size);
+				xmp_file_close(fh);
+			}
+		}
+		if (res < 0)
+			goto out;
+	}
+
+	if (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		struct timespec tv[2];
+
+		tv[0].tv_sec = 0;
+		tv[0].tv_nsec = UTIME_OMIT;
+		tv[1] = tv[0];
+		if (valid & FUSE_SET_ATTR_ATIME_NOW)
+			tv[0].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_ATIME)
+			tv[0] = attr->st_atim;
+		if (valid & FUSE_SET_ATTR_MTIME_NOW)
+			tv[1].tv_nsec = UTIME_NOW;
+		else if (valid & FUSE_SET_ATTR_MTIME)
+			tv[1] = attr->st_mtim;
+
+		if (fi != NULL)
+			res = futimens(XMP_FILE(fi)->fd, tv);
+		else
+			res = utimensat(AT_FDCWD, procpath, tv, 0);
+		if (res == -1)
+			goto out_errno;
+	}
+
+	res = xmp_inode_stat(node, &st);
+	if (res == 0) {
+		fuse_reply_attr(req, &st, XMP_DATA->attr_timeout);
+		return;
+	}
+	goto out;
+
+out_errno:
+	res = -errno;
+out:
+	xmp_reply_err(req, -res);
+}
+
+static void xmp_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	int res;
+	char procpath[XMP_PROC_PATH];
+
+	xmp_proc_path(procpath, xmp_inode(ino));
+	res = access(procpath, mask);
+	xmp_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void xmp_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	int res;
+	char buf[PATH_MAX + 1];
+
+	res = readlinkat(xmp_inode(ino)->fd, "", buf, sizeof(buf) - 1);
+	if (res == -1) {
+		xmp_reply_err(req, errno);
+		return;
+	}
+
+	buf[res] = '\0';
+	fuse_reply_readlink(req, buf);
+}
+
+static void xmp_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int fd;
+	struct xmp_dir *d;
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		xmp_reply_err(req, ENOMEM);
+		return;
+	}
+
+	fd = openat(xmp_inode(ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+	if (fd != -1)
+		d->dp = fdopendir(fd);
+	if (d->dp == NULL) {
+		int err = errno;
+		if (fd != -1)
+			close(fd);
+		free(d);
+		xmp_reply_err(req, err);
+		return;
+	}
+
+	d->lookups = __atomic_load_n(&xmp_inode(ino)->lookups, __ATOMIC_RELAXED);
+	fi->fh = (uintptr_t) d;
+	if (fuse_reply_open(req, fi) != 0) {
+		closedir(d->dp);
+		free(d);
+	}
+}
+
+/* FUSE 2.9 has no readdirplus, so the kernel follows readdir with a lookup per
+*	entry it wants attributes of (ls -l, find -size, ...). For each regular file
+*	it returns, readdir leaves the encrypted flag and plaintext size in the
+*	attribute cache, so each of those lookups is one fstatat instead of an
+*	fstatat and two getxattrs. Errors are left for that lookup to report.
+*	This costs three syscalls per entry, so xmp_readdir only does it while
+*	the directory is being looked into (see there).
+*/
+static void xmp_readdir_attrs(int dfd, const char *name)
+{
+	char path[XMP_PROC_PATH + NAME_MAX + 1];
+	struct stat st;
+	int encrypted;
+	off_t size;
+	unsigned long gen;
+
+	if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode) ||
+	    ac_lookup(XMP_DATA->attrs, &st, &encrypted, &size, &gen))
+		return;
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", dfd, name);
+	encrypted = xmp_is_encrypted(path);
+	size = -1;
+	/* A missing size is left for lookup, which recovers and records it */
+	if (encrypted && xmp_get_size(path, &size) < 0)
+		return;
+	ac_store(XMP_DATA->attrs, &st, encrypted, size, gen);
+}
+
+/* Fill one reply with as many entries as fit. An entry that does not fit is
+*	kept for the next call, which normally continues where this one stopped.
+*	ls -l and find -size look up each page of entries before reading the next,
+*	so attributes are prefilled only when names in the directory were looked
+*	up since the previous reply; a plain listing (ls, find -name) costs one
+*	getdents per reply, and ls -l pays full lookups for its first page only.
+*/
+static void xmp_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+{
+	struct xmp_dir *d = XMP_DIR(fi);
+	char *buf;
+	size_t used = 0;
+	size_t entsize;
+	unsigned long lookups;
+	int prefill;
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		xmp_reply_err(req, ENOMEM);
+		return;
+	}
+
+	if (offset != d->offset) {
+		seekdir(d->dp, offset);
+		d->entry = NULL;
+		d->offset = offset;
+	}
+
+	lookups = __atomic_load_n(&xmp_inode(ino)->lookups, __ATOMIC_RELAXED);
+	prefill = lookups != d->lookups;
+	d->lookups = lookups;
+
+	for (;;) {
+		struct stat st;
+
+		if (d->entry == NULL) {
+			errno = 0;
+			d->entry = readdir(d->dp);
+			if (d->entry == NULL) {
+				if (errno != 0 && used == 0) {
+					int err = errno;
+					free(buf);
+					xmp_reply_err(req, err);
+					return;
+				}
+				break;
+			}
+		}
+
+		memset(&st, 0, sizeof(st));
+		st.st_ino = d->entry->d_ino;
+		st.st_mode = d->entry->d_type << 12;
+		entsize = fuse_add_direntry(req, buf + used, size - used, d->entry->d_name, &st,
+					    d->entry->d_off);
+		if (entsize > size - used)
+			break;
+
+		used += entsize;
+		if (prefill && (d->entry->d_type == DT_REG || d->entry->d_type == DT_UNKNOWN))
+			xmp_readdir_attrs(dirfd(d->dp), d->entry->d_name);
+		d->offset = d->entry->d_off;
+		d->entry = NULL;
+	}
+
+	fuse_reply_buf(req, buf, used);
+	free(buf);
+}
+
+static void xmp_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct xmp_dir *d = XMP_DIR(fi);
+
+	(void) ino;
+
+	closedir(d->dp);
+	free(d);
+	xmp_reply_err(req, 0);
+}
+
+static void xmp_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, dev_t rdev)
+{
+	int res;
+	int dirfd = xmp_inode(parent)->fd;
+
+	/* On Linux this could just be 'mknodat(dirfd, name, mode, rdev)' but this
+	   is more portable */
+	if (S_ISREG(mode)) {
+		res = openat(dirfd, name, O_CREAT | O_EXCL | O_WRONLY, mode);
+		if (res >= 0)
+			res = close(res);
+	} else if (S_ISFIFO(mode))
+		res = mkfifoat(dirfd, name, mode);
+	else
+		res = mknodat(dirfd, name, mode, rdev);
+	if (res == -1) {
+		xmp_reply_err(req, errno);
+		return;
+	}
+
+	xmp_reply_entry(req, parent, name);
+}
+
+static void xmp_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	if (mkdirat(xmp_inode(parent)->fd, name, mode) == -1) {
+		xmp_reply_err(req, errno);
+		return;
+	}
+
+	xmp_reply_entry(req, parent, name);
+}
+
+static void xmp_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+	if (symlinkat(link, xmp_inode(parent)->fd, name) == -1) {
+		xmp_reply_err(req, errno);
+		return;
+	}
+
+	xmp_reply_entry(req, parent, name);
+}
+
+static void xmp_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+	char procpath[XMP_PROC_PATH];
+
+	xmp_proc_path(procpath, xmp_inode(ino));
+	if (linkat(AT_FDCWD, procpath, xmp_inode(newparent)->fd, newname, AT_SYMLINK_FOLLOW) == -1) {
+		xmp_reply_err(req, errno);
+		return;
+	}
+
+	xmp_reply_entry(req, newparent, newname);
+}
+
+static void xmp_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res;
+	int dirfd = xmp_inode(parent)->fd;
+
+	xmp_forget_cached(dirfd, name);
+	res = unlinkat(dirfd, name, 0);
+	xmp_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void xmp_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res;
+
+	res = unlinkat(xmp_inode(parent)->fd, name, AT_REMOVEDIR);
+	xmp_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void xmp_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+		       fuse_ino_t newparent, const char *newname)
+{
+	int res;
+	int dirfd = xmp_inode(parent)->fd;
+	int newdirfd = xmp_inode(newparent)->fd;
+
+	/* A file renamed over is removed, its inode number may be reused */
+	xmp_forget_cached(newdirfd, newname);
+	xmp_forget_attrs(dirfd, name);
+	res = renameat(dirfd, name, newdirfd, newname);
+	xmp_reply_err(req, res == -1 ? errno : 0);
+}
+
+/* Whether the kernel may keep the pages it cached of a file before this open.
+*	-o kernel_cache always lets it. -o auto_cache lets it only if the backing file
+*	is as it was when its last handle closed: writes through the mount keep the
+*	kernel's pages up to date, anything else (the mirror written directly, an
+*	xattr changed) moves the mtime, ctime or size.
+*/
+static int xmp_keep_cache(struct xmp_file *fh)
+{
+	int keep;
+	struct stat st;
+	struct xmp_inode *node = fh->node;
+
+	if (XMP_DATA->kernel_cache)
+		return 1;
+	if (!XMP_DATA->auto_cache || fstat(fh->fd, &st) == -1)
+		return 0;
+
+	pthread_rwlock_rdlock(&node->lock);
+	keep = node->cached && node->cached_size == st.st_size &&
+		node->cached_mtime.tv_sec == st.st_mtim.tv_sec &&
+		node->cached_mtime.tv_nsec == st.st_mtim.tv_nsec &&
+		node->cached_ctime.tv_sec == st.st_ctim.tv_sec &&
+		node->cached_ctime.tv_nsec == st.st_ctim.tv_nsec;
+	pthread_rwlock_unlock(&node->lock);
+
+	return keep;
+}
+
+/* Tell the kernel to drop the attributes and pages it cached of a file whose
+*	plaintext changed without it seeing a write. Must not be called before the
+*	request that caused it has been answered.
+*/
+static void xmp_inval_inode(fuse_ino_t ino)
+{
+	int res;
+
+	if (XMP_DATA->ch == NULL)
+		return;
+	res = fuse_lowlevel_notify_inval_inode(XMP_DATA->ch, ino, 0, 0);
+	/* -ENOENT: the kernel has nothing cached of it */
+	if (res < 0 && res != -ENOENT)
+		log_warn("invalidating inode %llu failed: %s", (unsigned long long) ino, strerror(-res));
+}
+
+/* Open allocates the handle that read, write, fsync and release work through */
+static void xmp_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int res;
+	struct xmp_file *fh;
+
+	res = xmp_file_open(xmp_inode(ino), fi->flags, &fh);
+	if (res < 0) {
+		xmp_reply_err(req, -res);
+		return;
+	}
+	log_trace("open %llu flags 0%o fd %d%s", (unsigned long long) ino, fi->flags, fh->fd,
+		  fh->encrypted ? " encrypted" : "");
+
+	fi->fh = (uintptr_t) fh;
+	fi->keep_cache = xmp_keep_cache(fh);
+	/* The open was interrupted, nobody will release the handle */
+	if (fuse_reply_open(req, fi) != 0)
+		xmp_file_close(fh);
+}
+
+/* Create a file with encrypted contents and encrypted flag
+* A new file is just the chunked format header; its plaintext size of 0 is recorded alongside
+*/
+static void xmp_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		       mode_t mode, struct fuse_file_info *fi)
+{
+	int res;
+	int fd;
+	int flags = fi->flags | O_CREAT | O_TRUNC;
+	struct xmp_file *fh;
+	struct xmp_inode *node;
+	struct fuse_entry_param e;
+
+	fd = openat(xmp_inode(parent)->fd, name, xmp_crypt_flags(flags), mode);
+	if (fd == -1) {
+		xmp_reply_err(req, errno);
+		return;
+	}
+
+	res = xmp_lookup_entry(parent, name, &e);
+	if (res < 0) {
+		close(fd);
+		xmp_reply_err(req, -res);
+		return;
+	}
+	node = xmp_inode(e.ino);
+
+	res = xmp_file_init(node, fd, flags, 1, &fh);
+	if (res < 0) {
+		close(fd);
+		xmp_inode_unref(node, 1);
+		xmp_reply_err(req, -res);
+		return;
+	}
+	log_trace("create %llu/%s mode 0%o fd %d", (unsigned long long) parent, name, mode, fh->fd);
+
+	e.attr.st_size = 0;
+	fi->fh = (uintptr_t) fh;
+	if (fuse_reply_create(req, &e, fi) != 0) {
+		xmp_file_close(fh);
+		xmp_inode_unref(node, 1);
+	}
+}
+
+/* This function reads file contents into application window.
+*	Unencrypted files are described to FUSE by their descriptor and offset, so it can
+*	splice the data from the mirror straight into /dev/fuse without copying it
+*	through this process. Encrypted files are decrypted into memory.
+*/
+static void xmp_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+		     off_t offset, struct fuse_file_info *fi)
+{
+	int res;
+	char *buf;
+	struct xmp_file *fh = XMP_FILE(fi);
+
+	log_trace("read %llu %zu bytes at %lld", (unsigned long long) ino, size, (long long) offset);
+
+	if (!fh->encrypted) {
+		struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+
+		src.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src.buf[0].fd = fh->fd;
+		src.buf[0].pos = offset;
+		fuse_reply_data(req, &src, FUSE_BUF_SPLICE_MOVE);
+		return;
+	}
+
+	buf = malloc(size ? size : 1);
+	if (buf == NULL) {
+		xmp_reply_err(req, ENOMEM);
+		return;
+	}
+	res = xmp_read_crypt(fh, buf, size, offset);
+	if (res < 0)
+		xmp_reply_err(req, -res);
+	else
+		fuse_reply_buf(req, buf, res);
+	free(buf);
+}
+
+/* Write contents to encrypted or unencrypted file.
+*	Unencrypted files get the data copied (spliced when FUSE received it into a pipe)
+*	straight to the backing descriptor. Encrypted files need it in memory to
+*	encrypt, so anything else is gathered into one buffer first.
+*/
+static void xmp_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	ssize_t res;
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	struct xmp_file *fh = XMP_FILE(fi);
+
+	log_trace("write %llu %zu bytes at %lld", (unsigned long long) ino, size, (long long) offset);
+
+	if (!fh->encrypted) {
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fh->fd;
+		dst.buf[0].pos = offset;
+		res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	} else if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+		res = xmp_write_crypt(fh, buf->buf[0].mem, size, offset);
+	} else {
+		dst.buf[0].mem = malloc(size ? size : 1);
+		if (dst.buf[0].mem == NULL) {
+			xmp_reply_err(req, ENOMEM);
+			return;
+		}
+		res = fuse_buf_copy(&dst, buf, 0);
+		if (res >= 0)
+			res = xmp_write_crypt(fh, dst.buf[0].mem, res, offset);
+		free(dst.buf[0].mem);
+	}
+
+	if (res < 0) {
+		log_error("write: %llu failed: %s", (unsigned long long) ino, strerror(-res));
+		xmp_reply_err(req, -res);
+	} else {
+		fuse_reply_write(req, res);
+	}
+}
+
+static void xmp_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs stbuf;
+
+	if (fstatvfs(xmp_inode(ino)->fd, &stbuf) == -1)
+		xmp_reply_err(req, errno);
+	else
+		fuse_reply_statfs(req, &stbuf);
+}
+
+/* Called on every close(2) of the file: buffered writes go to disk here so close
+*	can report a failure, which release cannot
+*/
+static void xmp_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int res;
+
+	log_trace("flush %llu", (unsigned long long) ino);
+	res = xmp_file_writeback(XMP_FILE(fi));
+	xmp_reply_err(req, -res);
+}
+
+/* The last close: anything written since the last flush is written out by
+*	xmp_file_close before the handle goes
+*/
+static void xmp_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	log_trace("release %llu", (unsigned long long) ino);
+
+	xmp_file_close(XMP_FILE(fi));
+	xmp_reply_err(req, 0);
+}
+
+static void xmp_fsync(fuse_req_t req, fuse_ino_t ino, int isdatasync,
+		      struct fuse_file_info *fi)
+{
+	int res;
+	struct xmp_file *fh = XMP_FILE(fi);
+
+	(void) ino;
+
+	/* Buffered writes first. The size attribute is written along with the data,
+	*	so fsync covers both
+	*/
+	res = xmp_file_writeback(fh);
+	if (res < 0) {
+		xmp_reply_err(req, -res);
+		return;
+	}
+	if (isdatasync)
+		res = fdatasync(fh->fd);
+	else
+		res = fsync(fh->fd);
+	xmp_reply_err(req, res == -1 ? errno : 0);
+}
+
+/* Ask for writes of up to max_write bytes per request instead of one page; the
+*	mount options (max_write, max_readahead, async_read) have been applied by now
+*/
+static void xmp_init(void *userdata, struct fuse_conn_info *conn)
+{
+	struct xmp_state *state = userdata;
+
+	/* Started here rather than in main, which forks to daemonize */
+	if (state->wb_max > 0) {
+		if (pthread_create(&state->wb_thread, NULL, xmp_wb_timer, state) == 0)
+			state->wb_running = 1;
+		else
+			log_warn("no write-back timer, buffers are written out on flush and fsync only");
+	}
+	if (state->ra_chunks > 0) {
+		if (pthread_create(&state->ra_thread, NULL, xmp_ra_thread, state) == 0)
+			state->ra_running = 1;
+		else
+			log_warn("no readahead thread, reads decrypt on demand only");
+	}
+
+	if (conn->capable & FUSE_CAP_BIG_WRITES)
+		conn->want |= FUSE_CAP_BIG_WRITES;
+
+	log_info("kernel protocol %u.%u, max_write %u, max_readahead %u, %s reads",
+		 conn->proto_major, conn->proto_minor, conn->max_write, conn->max_readahead,
+		 (conn->want & FUSE_CAP_ASYNC_READ) ? "async" : "sync");
+	log_info("attr_timeout %.1f, entry_timeout %.1f, negative_timeout %.1f, page cache %s",
+		 XMP_DATA->attr_timeout, XMP_DATA->entry_timeout, XMP_DATA->negative_timeout,
+		 XMP_DATA->kernel_cache ? "kept" : XMP_DATA->auto_cache ? "kept while unchanged" : "dropped on open");
+}
+
+/* Report how well the chunk cache did and free the caches and nodes at unmount */
+static void xmp_destroy(void *private_data)
+{
+	struct xmp_state *state = private_data;
+	struct xmp_inode *node;
+	struct xmp_inode *next;
+	struct bc_stats st;
+	size_t i;
+
+	if (state->wb_running) {
+		pthread_mutex_lock(&state->wb_lock);
+		state->wb_stop = 1;
+		pthread_cond_signal(&state->wb_cond);
+		pthread_mutex_unlock(&state->wb_lock);
+		pthread_join(state->wb_thread, NULL);
+		state->wb_running = 0;
+	}
+	if (state->ra_running) {
+		pthread_mutex_lock(&state->ra_lock);
+		state->ra_stop = 1;
+		pthread_cond_broadcast(&state->ra_cond);
+		pthread_mutex_unlock(&state->ra_lock);
+		pthread_join(state->ra_thread, NULL);
+		state->ra_running = 0;
+	}
+	/* Files still open when the connection went away are never released */
+	while (state->wb_head != NULL)
+		xmp_wb_flush_error(state->wb_head);
+
+	/* The kernel does not forget what it still holds at unmount */
+	for (i = 0; i < state->inode_buckets; i++) {
+		for (node = state->inodes[i]; node; node = next) {
+			next = node->next;
+			close(node->fd);
+			pthread_rwlock_destroy(&node->lock);
+			free(node);
+		}
+		state->inodes[i] = NULL;
+	}
+	state->ninodes = 0;
+	state->root = NULL;
+
+	ac_destroy(state->attrs);
+	state->attrs = NULL;
+
+	if (state->cache == NULL)
+		return;
+
+	bc_get_stats(state->cache, &st);
+	log_info("chunk cache: %llu hits, %llu misses, %llu evictions, %zu KiB in use",
+		(unsigned long long) st.hits, (unsigned long long) st.misses,
+		(unsigned long long) st.evictions, st.bytes / 1024);
+
+	bc_destroy(state->cache);
+	state->cache = NULL;
+}
+
+#ifdef HAVE_SETXATTR
+/* Returns 1 for the attributes pa4-encfs keeps its own state in */
+static int xmp_is_own_xattr(const char *name)
+{
+	return strcmp(name, XATRR_ENCRYPTED_FLAG) == 0 || strcmp(name, XATRR_PLAIN_SIZE) == 0;
+}
+
+/* Setting or removing the encrypted flag or size attribute changes what the file
+*	reads as and how large it is, so everything cached of it is dropped: our
+*	attribute cache now, the kernel's attributes and pages once the request is
+*	answered (the kernel may hold the inode locked until then).
+*/
+static void xmp_forget_own_xattr(fuse_req_t req, fuse_ino_t ino, struct xmp_inode *node)
+{
+	ac_forget(XMP_DATA->attrs, node->dev, node->ino);
+	pthread_rwlock_wrlock(&node->lock);
+	node->cached = 0;
+	pthread_rwlock_unlock(&node->lock);
+
+	xmp_reply_err(req, 0);
+	xmp_inval_inode(ino);
+}
+
+/* Text of XATRR_STATS: bytes through the cipher, chunk cache counters, then one
+*	line per operation (see es_format). Returns its length like snprintf.
+*/
+static size_t xmp_format_stats(char *buf, size_t size)
+{
+	struct aes_crypt_stats cs;
+	struct bc_stats bs;
+	int len;
+
+	aes_crypt_get_stats(&cs);
+	memset(&bs, 0, sizeof(bs));
+	if (XMP_DATA->cache != NULL)
+		bc_get_stats(XMP_DATA->cache, &bs);
+
+	len = snprintf(buf, size, "crypt encrypted_bytes=%llu decrypted_bytes=%llu\n"
+		       "chunk_cache hits=%llu misses=%llu evictions=%llu bytes=%zu capacity=%zu\n",
+		       cs.encrypted, cs.decrypted, (unsigned long long) bs.hits,
+		       (unsigned long long) bs.misses, (unsigned long long) bs.evictions,
+		       bs.bytes, bs.capacity);
+	if (len < 0)
+		return 0;
+	if ((size_t) len < size)
+		return len + es_format(XMP_DATA->stats, buf + len, size - len);
+	return len + es_format(XMP_DATA->stats, NULL, 0);
+}
+
+/* Reply to a getxattr of XATRR_STATS on the root */
+static void xmp_getxattr_stats(fuse_req_t req, size_t size)
+{
+	char *text;
+	size_t len;
+
+	text = malloc(XMP_STATS_MAX);
+	if (text == NULL) {
+		xmp_reply_err(req, ENOMEM);
+		return;
+	}
+
+	len = xmp_format_stats(text, XMP_STATS_MAX);
+	if (len >= XMP_STATS_MAX)
+		len = XMP_STATS_MAX - 1;
+	if (size == 0)
+		fuse_reply_xattr(req, len + XMP_STATS_SLACK < XMP_STATS_MAX ?
+				 len + XMP_STATS_SLACK : XMP_STATS_MAX);
+	else if (len > size)
+		xmp_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, text, len);
+	free(text);
+}
+
+/* xattr calls have no *at form, so they go through the node's /proc path. That
+*	would follow a symlink to its target, and user attributes cannot be set on
+*	symlinks anyway, so symlinks have none.
+*/
+static void xmp_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			 const char *value, size_t size, int flags)
+{
+	int res;
+	struct xmp_inode *node = xmp_inode(ino);
+	char procpath[XMP_PROC_PATH];
+
+	if (S_ISLNK(node->type)) {
+		xmp_reply_err(req, ENOTSUP);
+		return;
+	}
+	if (ino == FUSE_ROOT_ID && strcmp(name, XATRR_STATS) == 0) {
+		xmp_reply_err(req, EPERM);
+		return;
+	}
+
+	xmp_proc_path(procpath, node);
+	res = setxattr(procpath, name, value, size, flags);
+	if (res == 0 && xmp_is_own_xattr(name)) {
+		xmp_forget_own_xattr(req, ino, node);
+		return;
+	}
+	xmp_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void xmp_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	ssize_t res;
+	char *value = NULL;
+	struct xmp_inode *node = xmp_inode(ino);
+	char procpath[XMP_PROC_PATH];
+
+	if (S_ISLNK(node->type)) {
+		xmp_reply_err(req, ENOTSUP);
+		return;
+	}
+	if (ino == FUSE_ROOT_ID && strcmp(name, XATRR_STATS) == 0) {
+		xmp_getxattr_stats(req, size);
+		return;
+	}
+
+	/* A size of 0 asks how large the value is */
+	if (size > 0) {
+		value = malloc(size);
+		if (value == NULL) {
+			xmp_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	xmp_proc_path(procpath, node);
+	res = getxattr(procpath, name, value, size);
+	if (res == -1)
+		xmp_reply_err(req, errno);
+	else if (size > 0)
+		fuse_reply_buf(req, value, res);
+	else
+		fuse_reply_xattr(req, res);
+	free(value);
+}
+
+static void xmp_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+	ssize_t res;
+	char *list = NULL;
+	struct xmp_inode *node = xmp_inode(ino);
+	char procpath[XMP_PROC_PATH];
+
+	if (S_ISLNK(node->type)) {
+		xmp_reply_err(req, ENOTSUP);
+		return;
+	}
+
+	if (size > 0) {
+		list = malloc(size);
+		if (list == NULL) {
+			xmp_reply_err(req, ENOMEM);
+			return;
+		}
+	}
+
+	xmp_proc_path(procpath, node);
+	res = listxattr(procpath, list, size);
+	if (res == -1)
+		xmp_reply_err(req, errno);
+	else if (size > 0)
+		fuse_reply_buf(req, list, res);
+	else
+		fuse_reply_xattr(req, res);
+	free(list);
+}
+
+static void xmp_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+	int res;
+	struct xmp_inode *node = xmp_inode(ino);
+	char procpath[XMP_PROC_PATH];
+
+	if (S_ISLNK(node->type)) {
+		xmp_reply_err(req, ENOTSUP);
+		return;
+	}
+	if (ino == FUSE_ROOT_ID && strcmp(name, XATRR_STATS) == 0) {
+		xmp_reply_err(req, EPERM);
+		return;
+	}
+
+	xmp_proc_path(procpath, node);
+	res = removexattr(procpath, name);
+	if (res == 0 && xmp_is_own_xattr(name)) {
+		xmp_forget_own_xattr(req, ino, node);
+		return;
+	}
+	xmp_reply_err(req, res == -1 ? errno : 0);
+}
 #endif /* HAVE_SETXATTR */
 
-static struct fuse_operations xmp_oper = {
-	.getattr	= xmp_getattr,
-	.access		= xmp_access,
-	.readlink	= xmp_readlink,
-	.readdir	= xmp_readdir,
-	.mknod		= xmp_mknod,
-	.mkdir		= xmp_mkdir,
-	.symlink	= xmp_symlink,
-	.unlink		= xmp_unlink,
-	.rmdir		= xmp_rmdir,
-	.rename		= xmp_rename,
-	.link		= xmp_link,
-	.chmod		= xmp_chmod,
-	.chown		= xmp_chown,
-	.truncate	= xmp_truncate,
-	.utimens	= xmp_utimens,
-	.open		= xmp_open,
-	.read		= xmp_read,
-	.write		= xmp_write,
-	.statfs		= xmp_statfs,
-	.create         = xmp_create,
-	.release	= xmp_release,
-	.fsync		= xmp_fsync,
+/* Timed entry points: each runs its handler and records how long it took, and
+*	whether it answered with an error, under XMP_OP_<op> in XMP_DATA->stats.
+*/
+#define XMP_TIMED(op, name, params, args)				\
+static void xmp_##name##_timed params					\
+{									\
+	uint64_t start = es_now();					\
+									\
+	xmp_req_failed = 0;						\
+	xmp_##name args;						\
+	es_record(XMP_DATA->stats, XMP_OP_##op, start, xmp_req_failed);	\
+}
+
+XMP_TIMED(LOOKUP, lookup, (fuse_req_t req, fuse_ino_t parent, const char *name),
+	  (req, parent, name))
+XMP_TIMED(FORGET, forget, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup),
+	  (req, ino, nlookup))
+XMP_TIMED(FORGET_MULTI, forget_multi,
+	  (fuse_req_t req, size_t count, struct fuse_forget_data *forgets),
+	  (req, count, forgets))
+XMP_TIMED(GETATTR, getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	  (req, ino, fi))
+XMP_TIMED(SETATTR, setattr,
+	  (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int valid, struct fuse_file_info *fi),
+	  (req, ino, attr, valid, fi))
+XMP_TIMED(ACCESS, access, (fuse_req_t req, fuse_ino_t ino, int mask), (req, ino, mask))
+XMP_TIMED(READLINK, readlink, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+XMP_TIMED(OPENDIR, opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	  (req, ino, fi))
+XMP_TIMED(READDIR, readdir,
+	  (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+	  (req, ino, size, offset, fi))
+XMP_TIMED(RELEASEDIR, releasedir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	  (req, ino, fi))
+XMP_TIMED(MKNOD, mknod,
+	  (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev),
+	  (req, parent, name, mode, rdev))
+XMP_TIMED(MKDIR, mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+	  (req, parent, name, mode))
+XMP_TIMED(SYMLINK, symlink,
+	  (fuse_req_t req, const char *link, fuse_ino_t parent, const char *name),
+	  (req, link, parent, name))
+XMP_TIMED(UNLINK, unlink, (fuse_req_t req, fuse_ino_t parent, const char *name),
+	  (req, parent, name))
+XMP_TIMED(RMDIR, rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name),
+	  (req, parent, name))
+XMP_TIMED(RENAME, rename,
+	  (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+	   const char *newname),
+	  (req, parent, name, newparent, newname))
+XMP_TIMED(LINK, link,
+	  (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname),
+	  (req, ino, newparent, newname))
+XMP_TIMED(OPEN, open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	  (req, ino, fi))
+XMP_TIMED(READ, read,
+	  (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi),
+	  (req, ino, size, offset, fi))
+XMP_TIMED(WRITE_BUF, write_buf,
+	  (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf, off_t offset,
+	   struct fuse_file_info *fi),
+	  (req, ino, buf, offset, fi))
+XMP_TIMED(STATFS, statfs, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+XMP_TIMED(CREATE, create,
+	  (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+	   struct fuse_file_info *fi),
+	  (req, parent, name, mode, fi))
+XMP_TIMED(FLUSH, flush, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	  (req, ino, fi))
+XMP_TIMED(RELEASE, release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi),
+	  (req, ino, fi))
+XMP_TIMED(FSYNC, fsync,
+	  (fuse_req_t req, fuse_ino_t ino, int isdatasync, struct fuse_file_info *fi),
+	  (req, ino, isdatasync, fi))
 #ifdef HAVE_SETXATTR
-	.setxattr	= xmp_setxattr,
-	.getxattr	= xmp_getxattr,
-	.listxattr	= xmp_listxattr,
-	.removexattr	= xmp_removexattr,
+XMP_TIMED(SETXATTR, setxattr,
+	  (fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size,
+	   int flags),
+	  (req, ino, name, value, size, flags))
+XMP_TIMED(GETXATTR, getxattr,
+	  (fuse_req_t req, fuse_ino_t ino, const char *name, size_t size),
+	  (req, ino, name, size))
+XMP_TIMED(LISTXATTR, listxattr, (fuse_req_t req, fuse_ino_t ino, size_t size),
+	  (req, ino, size))
+XMP_TIMED(REMOVEXATTR, removexattr, (fuse_req_t req, fuse_ino_t ino, const char *name),
+	  (req, ino, name))
+#endif
+
+static struct fuse_lowlevel_ops xmp_oper = {
+	.init		= xmp_init,
+	.destroy	= xmp_destroy,
+	.lookup		= xmp_lookup_timed,
+	.forget		= xmp_forget_timed,
+	.forget_multi	= xmp_forget_multi_timed,
+	.getattr	= xmp_getattr_timed,
+	.setattr	= xmp_setattr_timed,
+	.access		= xmp_access_timed,
+	.readlink	= xmp_readlink_timed,
+	.opendir	= xmp_opendir_timed,
+	.readdir	= xmp_readdir_timed,
+	.releasedir	= xmp_releasedir_timed,
+	.mknod		= xmp_mknod_timed,
+	.mkdir		= xmp_mkdir_timed,
+	.symlink	= xmp_symlink_timed,
+	.unlink		= xmp_unlink_timed,
+	.rmdir		= xmp_rmdir_timed,
+	.rename		= xmp_rename_timed,
+	.link		= xmp_link_timed,
+	.open		= xmp_open_timed,
+	.read		= xmp_read_timed,
+	.write_buf	= xmp_write_buf_timed,
+	.statfs		= xmp_statfs_timed,
+	.create         = xmp_create_timed,
+	.flush		= xmp_flush_timed,
+	.release	= xmp_release_timed,
+	.fsync		= xmp_fsync_timed,
+#ifdef HAVE_SETXATTR
+	.setxattr	= xmp_setxattr_timed,
+	.getxattr	= xmp_getxattr_timed,
+	.listxattr	= xmp_listxattr_timed,
+	.removexattr	= xmp_removexattr_timed,
 #endif
 };
 
 int main(int argc, char *argv[])
 {
-	
+
+	int res = -1;
+	int fd;
+	struct stat st;
+	struct fuse_args args;
+	struct xmp_config config;
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	char *mountpoint = NULL;
+	int multithreaded;
+	int foreground;
+
 	umask(0);
 
 	/* Making sure there is the proper number of arguments */
@@ -773,38 +2758,210 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    /* From the tutorial Pfeiffer, Joseph. Writing a FUSE Filesystem: a Tutorial 
+    /* From the tutorial Pfeiffer, Joseph. Writing a FUSE Filesystem: a Tutorial
     * http: //www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/.
     *
-    * Allows Fuse to mirror a specific directory instead of the default root 
+    * Allows Fuse to mirror a specific directory instead of the default root
     */
 
     /* Initializing a struct to hold mirror directory and key phrase */
-    struct xmp_state *xmp_data;
-    xmp_data = malloc(sizeof(struct xmp_state));
+    xmp_data = calloc(1, sizeof(struct xmp_state));
     if(xmp_data == NULL){
         fprintf(stderr, "There was an error allocating memory for the state struct. Exiting.\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Pulling out mirror dirctory for VFS functions */
-    xmp_data->mirror_dir = realpath(argv[2], NULL);
+    /* Each node the kernel knows holds an O_PATH descriptor, so listing a directory
+    * of a few thousand files would run into the usual soft limit of 1024
+    */
+    {
+        struct rlimit rl;
+
+        if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+            rl.rlim_cur = rl.rlim_max;
+            if(setrlimit(RLIMIT_NOFILE, &rl) == -1)
+                fprintf(stderr, "Cannot raise the open file limit: %s\n", strerror(errno));
+        }
+    }
+
+    /* Opening the mirror directory once. Every operation works relative to this
+    * descriptor, so neither a relative path nor the directory being renamed while
+    * mounted matters, and no path is ever rebuilt from its name.
+    */
+    xmp_data->mirror_dir = argv[2];
+    fd = open(xmp_data->mirror_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &st) == -1){
+        fprintf(stderr, "Cannot open mirror directory '%s': %s. Exiting.\n", xmp_data->mirror_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
     /* Pulling out key phrase for encryption/decryption in write, read, create in fuse_operations */
     xmp_data->key_phrase = argv[1];
 
-    /* Displaying key_phrase and mirror path */
-    fprintf(stdout, "key_phrase = %s\n", xmp_data->key_phrase);
-    fprintf(stdout, "mirror_dir = %s\n", xmp_data->mirror_dir);
+    /* Deriving the AES key once here so file operations never repeat EVP_BytesToKey */
+    if(!derive_key(xmp_data->key_phrase, &xmp_data->key)){
+        fprintf(stderr, "There was an error deriving the key from the passphrase. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Passing the program name, mount point and any flags such as -d on to FUSE because it
+    * will use these to mount and run the session. Our own -o options are taken out on the way.
+    */
+    argv[2] = argv[0];
+    args.argc = argc - 2;
+    args.argv = argv + 2;
+    args.allocated = 0;
+
+    config.cache_mb = XMP_CACHE_MB;
+    config.cipher = NULL;
+    config.crypt_threads = 0;
+    config.crypt_min_kb = XMP_CRYPT_MIN_KB;
+    config.log_level = -1;
+    config.debug = 0;
+    config.attr_timeout = XMP_ATTR_TIMEOUT;
+    config.entry_timeout = XMP_ENTRY_TIMEOUT;
+    config.negative_timeout = XMP_NEGATIVE_TIMEOUT;
+    config.writeback_kb = XMP_WB_KB;
+    config.writeback_ms = XMP_WB_MS;
+    config.readahead_kb = XMP_RA_KB;
+    config.kernel_cache = 0;
+    config.auto_cache = 0;
+    if(fuse_opt_parse(&args, &config, xmp_opts, NULL) == -1){
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    /* -d turns on debug messages unless a level was given, or as many of them
+     * as this build has; only an explicit level above that is worth a warning */
+    if(config.log_level >= 0){
+        encfs_log_level = config.log_level;
+        if(encfs_log_level > ENCFS_LOG_MAX)
+            log_warn("log_level %d requested, this build only has messages up to %d (make DEBUG=1)",
+                     encfs_log_level, ENCFS_LOG_MAX);
+    }
+    else if(config.debug){
+        encfs_log_level = ENCFS_LOG_DEBUG < ENCFS_LOG_MAX ? ENCFS_LOG_DEBUG : ENCFS_LOG_MAX;
+    }
+
+    /* Cipher of new files; existing files keep the one named in their header */
+    xmp_data->cipher = CF_CIPHER_AES256_CTR;
+    if(config.cipher != NULL){
+        xmp_data->cipher = cf_cipher_by_name(config.cipher);
+        if(xmp_data->cipher < 0){
+            fprintf(stderr, "Unknown cipher '%s'.\n", config.cipher);
+            fprintf(stderr, USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* How long the kernel may trust what we tell it, and whether file contents it
+    * cached survive an open
+    */
+    xmp_data->attr_timeout = config.attr_timeout;
+    xmp_data->entry_timeout = config.entry_timeout;
+    xmp_data->negative_timeout = config.negative_timeout;
+    xmp_data->kernel_cache = config.kernel_cache;
+    xmp_data->auto_cache = config.auto_cache;
+
+    /* Write-back of small encrypted writes; the timer waits on a monotonic clock */
+    xmp_data->wb_max = (size_t) config.writeback_kb << 10;
+    xmp_data->wb_delay_ms = config.writeback_ms;
+    pthread_mutex_init(&xmp_data->wb_lock, NULL);
+    {
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&xmp_data->wb_cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
 
-    /* Passing only 3 arguments, this includes any flags such as -d, from argv to fuse_main because fuse main will
-    * use these in other fuse functions: program name and mount point and optional flags
+    /* Readahead into the chunk cache, which it would be pointless without. A
+    * window over a quarter of the cache would evict what it decrypts before use.
     */
-    argv[1] = argv[3];//Moving mount directory to second argument
-    argv[2] = argv[4];//Moving flag to third argument
-    argv[3] = NULL;
-    argv[4] = NULL;
-    argc = argc - 2; // making sure number of arguments matches up with size of argv
+    pthread_mutex_init(&xmp_data->ra_lock, NULL);
+    pthread_cond_init(&xmp_data->ra_cond, NULL);
+    xmp_data->ra_chunks = 0;
+    if(config.cache_mb > 0){
+        if(config.readahead_kb > config.cache_mb * 1024 / 4)
+            config.readahead_kb = config.cache_mb * 1024 / 4;
+        xmp_data->ra_chunks = ((off_t) config.readahead_kb << 10) / CF_DEFAULT_CHUNK;
+    }
+
+    /* Worker pool for large requests, started on first use after FUSE daemonizes */
+    aes_crypt_set_workers(config.crypt_threads, (size_t) config.crypt_min_kb << 10);
+
+    /* Displaying mirror path */
+    log_info("mirror_dir = %s", xmp_data->mirror_dir);
+
+    /* Table of nodes the kernel knows, shared by all FUSE worker threads */
+    pthread_mutex_init(&xmp_data->inode_lock, NULL);
+    xmp_data->inode_buckets = XMP_INODE_BUCKETS;
+    xmp_data->inodes = calloc(XMP_INODE_BUCKETS, sizeof(*xmp_data->inodes));
+    if(xmp_data->inodes == NULL){
+        fprintf(stderr, "There was an error allocating the node table. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The mirror directory is the root node; the kernel never forgets it */
+    xmp_data->root = xmp_inode_get(&st, fd);
+    if(xmp_data->root == NULL){
+        fprintf(stderr, "There was an error allocating the root node. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+    xmp_data->root->nlookup++;
+
+    /* Encrypted flag and size per inode for getattr */
+    xmp_data->attrs = ac_create(XMP_ATTR_SLOTS);
+    if(xmp_data->attrs == NULL){
+        fprintf(stderr, "There was an error allocating the attribute cache. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Per-operation counters, read through the XATRR_STATS attribute of the root */
+    xmp_data->stats = es_create(xmp_op_names, XMP_NOPS);
+    if(xmp_data->stats == NULL){
+        fprintf(stderr, "There was an error allocating the operation counters. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Decrypted chunk cache, sized by -o cache_mb */
+    xmp_data->cache = NULL;
+    if(config.cache_mb > 0){
+        xmp_data->cache = bc_create((size_t) config.cache_mb << 20, CF_DEFAULT_CHUNK);
+        if(xmp_data->cache == NULL){
+            fprintf(stderr, "There was an error allocating the chunk cache. Exiting.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* What fuse_main does for the high-level API: mount, run the session loop
+    * (multithreaded unless -s) and unmount again
+    */
+    if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL){
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    ch = fuse_mount(mountpoint, &args);
+    if(ch != NULL){
+        se = fuse_lowlevel_new(&args, &xmp_oper, sizeof(xmp_oper), xmp_data);
+        if(se != NULL){
+            if(fuse_set_signal_handlers(se) != -1){
+                fuse_session_add_chan(se, ch);
+                xmp_data->ch = ch;
+                if(fuse_daemonize(foreground) != -1)
+                    res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                xmp_data->ch = NULL;
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
 
-	return fuse_main(argc, argv, &xmp_oper, xmp_data);
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return res ? EXIT_FAILURE : EXIT_SUCCESS;
 }